@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# End to end timings of the tools on generated trees. Every result is
+# printed as a tab separated line of the tool and how it was run, the
+# number of files and the seconds it took.
+#
+# BENCH_DIR is where the trees are made, BENCH_FILES the file counts.
+
+set -e
+
+dir=${BENCH_DIR:-/tmp/tools-bench}
+counts=${BENCH_FILES:-"10000 1000000 10000000"}
+here=$(cd "$(dirname "$0")" && pwd)
+
+# needs a date with %N for fractions of seconds, like GNU date
+now() {
+	date +%s.%N
+}
+
+# run name count command..., the output of the command is dropped
+run() {
+	name=$1 count=$2
+	shift 2
+	start=$(now)
+	"$@" >/dev/null
+	end=$(now)
+	awk -v name="$name" -v count="$count" -v s="$start" -v e="$end" \
+	    'BEGIN { printf "e2e\t%s\t%s\t%.3f\n", name, count, e - s }'
+}
+
+for count in $counts; do
+	tree=$dir/tree-$count
+	rm -rf "$tree" "$dir/moved-$count"
+
+	run mktree "$count" "$here/mktree" -n "$count" -l -s 1k,100m \
+	    -S 1 "$tree"
+	run fit-n "$count" "$here/fit" -r -s 4700m -n "$tree"
+	run fit-best "$count" "$here/fit" -r -a best -s 4700m -p nul "$tree"
+	run fit-plan "$count" "$here/fit" -r -s 700m,4700m,25g "$tree"
+	run fit-index "$count" "$here/fit" -r -s 4700m -n \
+	    -i "$dir/index-$count" "$tree"
+	run fit-indexed "$count" "$here/fit" -r -s 4700m -n \
+	    -i "$dir/index-$count" "$tree"
+	run shuffle-e "$count" "$here/shuffle" -p "$tree" -e mp3,flac,ogg \
+	    -S 1 -n 0 true
+	run shuffle-j "$count" "$here/shuffle" -p "$tree" -e sid -j 4 \
+	    -n 1000 true
+
+	mkdir -p "$dir/moved-$count"
+	run mvd "$count" sh -c "find '$tree' -type f -print0 |
+	    '$here/mvd' -0 '$dir/moved-$count'"
+
+	rm -rf "$tree" "$dir/moved-$count" "$dir/index-$count"
+done
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 600
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binpack.h"
+#include "rng.h"
+#include "utils.h"
+
+/* number of items at the start of sizes larger than size */
+static size_t
+count_larger(const off_t *sizes, size_t n, off_t size)
+{
+	size_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (sizes[mid] > size)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * The L2 lower bound of Martello and Toth on the number of bins it
+ * takes. For every alpha up to half the capacity the items larger
+ * than capacity - alpha each need a bin of their own as do the items
+ * larger than half the capacity. What is left of the items of at least
+ * alpha after filling up the latter bins needs bins of its own. Only
+ * the item sizes need to be tried as alpha.
+ */
+size_t
+binpack_lower_bound(const off_t *sizes, size_t n, off_t capacity)
+{
+	off_t *sums, half = capacity / 2;
+	size_t i, bound, nbig;
+
+	/* sums[i] is the total size of the first i items */
+	sums = xcalloc(n + 1, sizeof(sums[0]));
+	for (i = 0; i < n; ++i)
+		sums[i + 1] = sums[i] + sizes[i];
+
+	/* the plain bound of the total size, which is alpha = 0 */
+	bound = (sums[n] + capacity - 1) / capacity;
+
+	nbig = count_larger(sizes, n, half);
+	for (i = nbig; i < n; ++i) {
+		off_t alpha = sizes[i], left;
+		size_t j1, j2, j3;
+
+		if (alpha == 0)
+			break;
+
+		/* only the last item of some size counts */
+		if (i + 1 < n && sizes[i + 1] == alpha)
+			continue;
+
+		j1 = count_larger(sizes, nbig, capacity - alpha);
+		j2 = nbig - j1;
+		j3 = i + 1;
+
+		/* the room the second group leaves the third */
+		left = (sums[j3] - sums[nbig]) -
+		    ((off_t)j2 * capacity - (sums[nbig] - sums[j1]));
+
+		if (left < 0)
+			left = 0;
+
+		if (nbig + (left + capacity - 1) / capacity > bound)
+			bound = nbig + (left + capacity - 1) / capacity;
+	}
+
+	if (nbig > bound)
+		bound = nbig;
+
+	xfree(sums);
+
+	return bound;
+}
+
+/* a packing a search thread works on */
+struct packing {
+	size_t *bin_of;
+	off_t *load;
+	size_t *count;
+	size_t nbins;
+};
+
+struct search {
+	pthread_mutex_t lock;
+	const off_t *sizes;
+	size_t n;
+	off_t capacity;
+	size_t bound;
+	struct timespec deadline;
+	uint64_t seed;
+	int nthreads;
+
+	/* the best packing found so far */
+	size_t *best;
+	size_t nbest;
+};
+
+/* steps between looking at the clock and the other threads */
+#define SEARCH_ROUND 65536
+
+static int
+timed_out(const struct search *search)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec > search->deadline.tv_sec ||
+	    (now.tv_sec == search->deadline.tv_sec &&
+	    now.tv_nsec >= search->deadline.tv_nsec);
+}
+
+static void
+packing_load(struct packing *packing, const struct search *search,
+    const size_t *bin_of, size_t nbins)
+{
+	size_t i;
+
+	memcpy(packing->bin_of, bin_of, search->n * sizeof(bin_of[0]));
+	memset(packing->load, 0, nbins * sizeof(packing->load[0]));
+	memset(packing->count, 0, nbins * sizeof(packing->count[0]));
+	for (i = 0; i < search->n; ++i) {
+		packing->load[bin_of[i]] += search->sizes[i];
+		++packing->count[bin_of[i]];
+	}
+	packing->nbins = nbins;
+}
+
+/* drop an empty bin, the last bin takes its place */
+static void
+packing_remove(struct packing *packing, size_t bin, size_t n)
+{
+	size_t i, last = --packing->nbins;
+
+	if (bin == last)
+		return;
+
+	for (i = 0; i < n; ++i)
+		if (packing->bin_of[i] == last)
+			packing->bin_of[i] = bin;
+
+	packing->load[bin] = packing->load[last];
+	packing->count[bin] = packing->count[last];
+}
+
+/*
+ * Take a random step which moves an item to another bin or swaps two
+ * items of different bins. Steps are taken when they don't lower the
+ * sum of the squared loads, which favours full bins over half full
+ * ones until bins empty out. Returns TRUE when a bin did.
+ */
+static int
+search_step(struct packing *packing, const struct search *search,
+    struct rng *rng)
+{
+	const off_t *sizes = search->sizes;
+	off_t *load = packing->load;
+	size_t item, other, a, b;
+	double la, lb, delta;
+
+	item = rng_below(rng, search->n);
+	a = packing->bin_of[item];
+	la = (double)load[a];
+
+	if (rng_below(rng, 2) == 0) {
+		b = rng_below(rng, packing->nbins);
+		if (b == a || load[b] + sizes[item] > search->capacity)
+			return FALSE;
+
+		lb = (double)load[b];
+		delta = 2.0 * sizes[item] * (lb - la + sizes[item]);
+		if (delta < 0)
+			return FALSE;
+
+		packing->bin_of[item] = b;
+		load[a] -= sizes[item];
+		load[b] += sizes[item];
+		++packing->count[b];
+		if (--packing->count[a] == 0) {
+			packing_remove(packing, a, search->n);
+			return TRUE;
+		}
+
+		return FALSE;
+	}
+
+	other = rng_below(rng, search->n);
+	b = packing->bin_of[other];
+	if (b == a || sizes[item] == sizes[other] ||
+	    load[a] - sizes[item] + sizes[other] > search->capacity ||
+	    load[b] - sizes[other] + sizes[item] > search->capacity)
+		return FALSE;
+
+	/* the change of la^2 + lb^2 when d moves from a to b */
+	lb = (double)load[b];
+	delta = (double)(sizes[item] - sizes[other]);
+	delta = 2.0 * delta * (lb - la + delta);
+	if (delta < 0)
+		return FALSE;
+
+	packing->bin_of[item] = b;
+	packing->bin_of[other] = a;
+	load[a] += sizes[other] - sizes[item];
+	load[b] += sizes[item] - sizes[other];
+
+	return FALSE;
+}
+
+static void *
+search_worker(void *search_ptr)
+{
+	struct search *search = search_ptr;
+	struct packing packing;
+	struct rng rng;
+
+	pthread_mutex_lock(&search->lock);
+	rng_seed(&rng, search->seed + search->nthreads++);
+	pthread_mutex_unlock(&search->lock);
+
+	packing.bin_of = xcalloc(search->n, sizeof(packing.bin_of[0]));
+	packing.load = xcalloc(search->n, sizeof(packing.load[0]));
+	packing.count = xcalloc(search->n, sizeof(packing.count[0]));
+	packing.nbins = 0;
+
+	for (;;) {
+		int done, improved = FALSE;
+		size_t i;
+
+		/* carry on from the best packing when another thread has it */
+		pthread_mutex_lock(&search->lock);
+		done = search->nbest <= search->bound;
+		if (!done && (packing.nbins == 0 ||
+		    search->nbest < packing.nbins))
+			packing_load(&packing, search, search->best,
+			    search->nbest);
+		pthread_mutex_unlock(&search->lock);
+
+		if (done || packing.nbins <= 1 || timed_out(search))
+			break;
+
+		for (i = 0; i < SEARCH_ROUND; ++i)
+			if (search_step(&packing, search, &rng))
+				improved = TRUE;
+
+		if (!improved)
+			continue;
+
+		pthread_mutex_lock(&search->lock);
+		if (packing.nbins < search->nbest) {
+			memcpy(search->best, packing.bin_of,
+			    search->n * sizeof(search->best[0]));
+			search->nbest = packing.nbins;
+		}
+		pthread_mutex_unlock(&search->lock);
+	}
+
+	xfree(packing.bin_of);
+	xfree(packing.load);
+	xfree(packing.count);
+
+	return NULL;
+}
+
+/*
+ * Improve the packing in bin_of for up to the given number of seconds
+ * or until it takes no more bins than bound, with a search thread per
+ * cpu. Returns the number of bins it takes afterwards, bins are
+ * numbered from 0 without gaps.
+ */
+size_t
+binpack_improve(const off_t *sizes, size_t n, off_t capacity,
+    size_t *bin_of, size_t nbins, size_t bound, double seconds)
+{
+	struct search search;
+	pthread_t *threads;
+	int i, nthreads;
+
+	if (n == 0 || seconds <= 0)
+		return nbins;
+
+	pthread_mutex_init(&search.lock, NULL);
+	search.sizes = sizes;
+	search.n = n;
+	search.capacity = capacity;
+	search.bound = bound;
+	search.seed = (uint64_t)time(NULL) ^ getpid();
+	search.nthreads = 0;
+	search.best = bin_of;
+	search.nbest = nbins;
+
+	clock_gettime(CLOCK_MONOTONIC, &search.deadline);
+	search.deadline.tv_sec += (time_t)seconds;
+	search.deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+	if (search.deadline.tv_nsec >= 1000000000L) {
+		++search.deadline.tv_sec;
+		search.deadline.tv_nsec -= 1000000000L;
+	}
+
+	nthreads = cpu_count();
+	threads = xcalloc(nthreads, sizeof(threads[0]));
+	for (i = 0; i < nthreads; ++i)
+		if (pthread_create(&threads[i], NULL, search_worker,
+		    &search) != 0)
+			die("Can't create search thread.");
+
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&search.lock);
+	xfree(threads);
+
+	return search.nbest;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BINPACK_H
+#define BINPACK_H
+
+#include <sys/types.h>
+
+/*
+ * Tools to get closer to an optimal packing of items on bins of the
+ * same capacity. Items are given by their sizes, for the lower bound
+ * sorted largest first, and a packing by the bin of every item.
+ */
+
+/* the bin of an item which is not packed */
+#define BINPACK_NONE ((size_t)-1)
+
+size_t binpack_lower_bound(const off_t *, size_t, off_t);
+size_t binpack_improve(const off_t *, size_t, off_t, size_t *, size_t,
+    size_t, double);
+
+#endif
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#define _XOPEN_SOURCE 600
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "filter.h"
+#include "utils.h"
+
+void
+filter_init(struct filter *filter)
+{
+	memset(filter, 0, sizeof(*filter));
+}
+
+void
+filter_free(struct filter *filter)
+{
+	size_t i;
+
+	for (i = 0; i < filter->npatterns; ++i)
+		xfree(filter->patterns[i]);
+	xfree(filter->patterns);
+	xfree(filter->nodes);
+}
+
+/* insert a stage after the ones which cost the same or less */
+void
+filter_add(struct filter *filter, filter_fn fn, void *arg, int cost)
+{
+	size_t i;
+
+	if (filter->nstages == FILTER_MAX_STAGES)
+		die("Too many filters.");
+
+	for (i = filter->nstages; i > 0; --i) {
+		if (filter->stages[i - 1].cost <= cost)
+			break;
+		filter->stages[i] = filter->stages[i - 1];
+	}
+
+	filter->stages[i].fn = fn;
+	filter->stages[i].arg = arg;
+	filter->stages[i].cost = cost;
+	++filter->nstages;
+
+	if (cost >= FILTER_STAT)
+		filter->flags |= WALK_STAT;
+}
+
+/* the ] closing the set p starts, a ] first in the set is part of it */
+static const char *
+set_end(const char *p)
+{
+	++p;
+	if (*p == '!' || *p == '^')
+		++p;
+	if (*p == ']')
+		++p;
+
+	return strchr(p, ']');
+}
+
+/*
+ * Match name against a shell pattern with *, ? and [...] ignoring
+ * case. A * backtracks to just after the last one seen, which is
+ * enough as nothing after it can be matched in another way.
+ */
+static int
+glob_match(const char *pattern, const char *name)
+{
+	const char *star = NULL, *resume = NULL;
+
+	while (*name != '\0') {
+		const char *p = pattern, *end;
+		int c = tolower((uchar)*name), matched = FALSE;
+
+		if (*p == '*') {
+			star = ++pattern;
+			resume = name;
+			continue;
+		}
+
+		if (*p == '?') {
+			matched = TRUE;
+			++p;
+		} else if (*p == '[' && (end = set_end(p)) != NULL) {
+			int negate = p[1] == '!' || p[1] == '^';
+
+			for (p += negate ? 2 : 1; p < end; ++p) {
+				int lo = tolower((uchar)*p), hi = lo;
+
+				if (p[1] == '-' && p + 2 < end) {
+					hi = tolower((uchar)p[2]);
+					p += 2;
+				}
+				if (c >= lo && c <= hi)
+					matched = TRUE;
+			}
+			p = end + 1;
+			matched ^= negate;
+		} else if (*p != '\0' && tolower((uchar)*p) == c) {
+			matched = TRUE;
+			++p;
+		}
+
+		if (matched) {
+			pattern = p;
+			++name;
+		} else if (star != NULL) {
+			pattern = star;
+			name = ++resume;
+		} else
+			return FALSE;
+	}
+
+	while (*pattern == '*')
+		++pattern;
+
+	return *pattern == '\0';
+}
+
+/* add a suffix to the trie, from its last character to its first */
+static void
+add_suffix(struct filter *filter, const char *suffix, size_t len)
+{
+	uint32_t node = 0;
+
+	if (filter->nnodes == 0) {
+		filter->nodes = xcalloc(1, sizeof(filter->nodes[0]));
+		filter->nnodes = 1;
+	}
+
+	while (len-- > 0) {
+		int c = tolower((uchar)suffix[len]);
+		uint32_t child;
+
+		for (child = filter->nodes[node].child; child != 0;
+		    child = filter->nodes[child].sibling)
+			if (filter->nodes[child].c == c)
+				break;
+
+		if (child == 0) {
+			if (filter->nnodes == UINT32_MAX)
+				die("Too many patterns.");
+
+			child = filter->nnodes++;
+			filter->nodes = xrealloc(filter->nodes,
+			    filter->nnodes * sizeof(filter->nodes[0]));
+			memset(&filter->nodes[child], 0,
+			    sizeof(filter->nodes[0]));
+			filter->nodes[child].c = c;
+			filter->nodes[child].sibling =
+			    filter->nodes[node].child;
+			filter->nodes[node].child = child;
+		}
+
+		node = child;
+	}
+
+	filter->nodes[node].end = TRUE;
+}
+
+/* walk the name back to front down the trie until a suffix ends */
+static int
+suffix_matches(const struct filter *filter, const char *name, size_t len)
+{
+	uint32_t node = 0;
+
+	if (filter->nnodes == 0)
+		return FALSE;
+
+	while (!filter->nodes[node].end) {
+		uint32_t child;
+		int c;
+
+		if (len == 0)
+			return FALSE;
+		c = tolower((uchar)name[--len]);
+
+		for (child = filter->nodes[node].child; child != 0;
+		    child = filter->nodes[child].sibling)
+			if (filter->nodes[child].c == c)
+				break;
+
+		if (child == 0)
+			return FALSE;
+		node = child;
+	}
+
+	return TRUE;
+}
+
+static int
+name_matches(const struct walk_entry *ent, void *filter_ptr)
+{
+	const struct filter *filter = filter_ptr;
+	size_t i;
+
+	if (suffix_matches(filter, ent->name, ent->namelen))
+		return TRUE;
+
+	for (i = 0; i < filter->npatterns; ++i)
+		if (glob_match(filter->patterns[i], ent->name))
+			return TRUE;
+
+	return FALSE;
+}
+
+static int
+size_matches(const struct walk_entry *ent, void *filter_ptr)
+{
+	const struct filter *filter = filter_ptr;
+
+	return ent->st->st_size >= filter->min_size &&
+	    (filter->max_size < 0 || ent->st->st_size <= filter->max_size);
+}
+
+static int
+mtime_matches(const struct walk_entry *ent, void *filter_ptr)
+{
+	const struct filter *filter = filter_ptr;
+
+	return ent->st->st_mtime >= filter->from &&
+	    (filter->until == (time_t)-1 || ent->st->st_mtime < filter->until);
+}
+
+/*
+ * A file passes if its name matches any of the patterns. Patterns
+ * which are a * followed by plain characters only look at the end of
+ * the name, they are all matched at once in a single walk of the trie.
+ */
+void
+filter_add_name(struct filter *filter, const char *pattern)
+{
+	if (filter->npatterns == 0 && filter->nnodes == 0)
+		filter_add(filter, name_matches, filter, FILTER_NAME);
+
+	if (pattern[0] == '*' && strpbrk(pattern + 1, "*?[") == NULL) {
+		add_suffix(filter, pattern + 1, strlen(pattern + 1));
+		return;
+	}
+
+	filter->patterns = xrealloc(filter->patterns,
+	    (filter->npatterns + 1) * sizeof(filter->patterns[0]));
+	filter->patterns[filter->npatterns++] = xstrdup(pattern);
+}
+
+/* a negative max has no upper bound */
+void
+filter_add_size(struct filter *filter, off_t min, off_t max)
+{
+	filter->min_size = min;
+	filter->max_size = max;
+	filter_add(filter, size_matches, filter, FILTER_STAT);
+}
+
+/* an until of -1 has no upper bound */
+void
+filter_add_mtime(struct filter *filter, time_t from, time_t until)
+{
+	filter->from = from;
+	filter->until = until;
+	filter_add(filter, mtime_matches, filter, FILTER_STAT);
+}
+
+/* a local time like 2024-01-31, optionally followed by 12:00[:00] */
+static int
+parse_time(const char *str, time_t *t)
+{
+	static const char *const formats[] = {
+		"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d"
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+		struct tm tm;
+		const char *end;
+
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(str, formats[i], &tm);
+		if (end == NULL || *end != '\0')
+			continue;
+
+		tm.tm_isdst = -1;
+		*t = mktime(&tm);
+		return *t != (time_t)-1;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Handle one of the filter options the tools share. -N adds a name
+ * pattern, -Z min,max a size range and -M from,until a range of
+ * modification times, either side of a range can be left out.
+ * Returns FALSE if the option or its argument isn't valid.
+ */
+int
+filter_option(struct filter *filter, int option, const char *arg)
+{
+	char *lo, *hi;
+	int ok = TRUE;
+
+	if (option == 'N') {
+		filter_add_name(filter, arg);
+		return TRUE;
+	}
+
+	if (option != 'Z' && option != 'M')
+		return FALSE;
+
+	lo = xstrdup(arg);
+	hi = strchr(lo, ',');
+	if (hi == NULL) {
+		xfree(lo);
+		return FALSE;
+	}
+	*hi++ = '\0';
+
+	if (option == 'Z') {
+		off_t min = 0, max = -1;
+
+		if (*lo != '\0' && (min = string_to_number(lo)) < 0)
+			ok = FALSE;
+		if (*hi != '\0' && (max = string_to_number(hi)) < 0)
+			ok = FALSE;
+		if (ok)
+			filter_add_size(filter, min, max);
+	} else {
+		time_t from = 0, until = -1;
+
+		if (*lo != '\0' && !parse_time(lo, &from))
+			ok = FALSE;
+		if (*hi != '\0' && !parse_time(hi, &until))
+			ok = FALSE;
+		if (ok)
+			filter_add_mtime(filter, from, until);
+	}
+
+	xfree(lo);
+
+	return ok;
+}
+
+int
+filter_match(const struct filter *filter, const struct walk_entry *ent)
+{
+	size_t i;
+
+	for (i = 0; i < filter->nstages; ++i)
+		if (!filter->stages[i].fn(ent, filter->stages[i].arg))
+			return FALSE;
+
+	return TRUE;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * A pipeline of checks a file found has to pass. Stages run from the
+ * cheapest to the most expensive and the first one a file fails stops
+ * it, so costly checks only see the files which passed the others.
+ */
+#define FILTER_MAX_STAGES 8
+
+/* what a stage costs, stages of the same cost run in the order added */
+enum { FILTER_NAME, FILTER_STAT, FILTER_READ };
+
+struct walk_entry;
+
+typedef int (*filter_fn)(const struct walk_entry *, void *);
+
+/*
+ * A node of a trie of the name suffixes patterns like *.flac match,
+ * read back to front. Children are a list linked through their next
+ * siblings, 0 ends a list as the root is nobody's child.
+ */
+struct filter_node {
+	uint32_t child;
+	uint32_t sibling;
+	unsigned char c;		/* lower case */
+	unsigned char end;		/* a suffix ends here */
+};
+
+struct filter_stage {
+	filter_fn fn;
+	void *arg;
+	int cost;
+};
+
+struct filter {
+	struct filter_stage stages[FILTER_MAX_STAGES];
+	size_t nstages;
+	int flags;			/* walk flags the stages need */
+
+	/*
+	 * case insensitive patterns for the name, the ones which are just
+	 * a suffix go in the trie
+	 */
+	char **patterns;
+	size_t npatterns;
+	struct filter_node *nodes;
+	size_t nnodes;
+
+	/* inclusive size range and modification times [from, until) */
+	off_t min_size;
+	off_t max_size;
+	time_t from;
+	time_t until;
+};
+
+void filter_init(struct filter *);
+void filter_free(struct filter *);
+void filter_add(struct filter *, filter_fn, void *, int);
+void filter_add_name(struct filter *, const char *);
+void filter_add_size(struct filter *, off_t, off_t);
+void filter_add_mtime(struct filter *, time_t, time_t);
+int filter_option(struct filter *, int, const char *);
+int filter_match(const struct filter *, const struct walk_entry *);
+
+#endif
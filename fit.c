@@ -14,293 +14,2724 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-static const char *const usage_string = "\
-usage:  fit -s size [-l destination] [-nr] path [path ...]\n\
+/* split in parts, C89 doesn't guarantee longer string literals */
+static const char *const usage_string[] = { "\
+usage:  fit -s size[,size ...] [-a algorithm] [-b size] [-d size] [-f size]\n\
+        [-e manifest] [-i index] [-l destination [-m method]] [-L size]\n\
+        [-o seconds] [-p format] [-N pattern] [-M from,until] [-Z min,max]\n\
+        [-nrTuv] path [path ...]\n\
 \n\
 options:\n\
-  -l destination Directory to link files into,\n\
+", "\
+  -a algorithm   Placement algorithm, first (default) or best fit.\n\
+  -b size        Round files up to blocks of this size, 0 uses the\n\
+                 space they take up now.\n\
+  -d size        Space every directory takes up on a disk.\n\
+  -e manifest    Extend the disks of a manifest written with -p,\n\
+                 only placing the files which aren't on them yet.\n\
+  -f size        Space every file takes up besides its data.\n\
+", "\
+  -i index       Keep an index of the paths in this file and only\n\
+                 read the directories that changed since.\n\
+  -l destination Directory to put the disks in,\n\
                  if omitted just print the disks.\n\
+  -L size        Keep about this much in memory, the files found go\n\
+                 to a temporary file. Needs -n or a manifest format.\n\
+", "\
+  -m method      How disks are put in the destination, link (default)\n\
+                 or copy their files to a directory per disk or\n\
+                 write a tar archive per disk.\n\
   -n             Just show the number of disks it takes.\n\
+  -o seconds     Spend up to this many seconds trying to use fewer\n\
+                 disks and show how many it takes at least.\n\
+", "\
+  -p format      Print the disks as human (default) readable text or\n\
+                 a manifest of NUL terminated records, json lines or\n\
+                 csv with the disk, size in bytes and path per file.\n\
   -r             Do a recursive search.\n\
-  -s size        Disk size in k, m, g, or t.\n\
+", "\
+  -s size        Disk size in k, m, g, or t. Given a comma separated\n\
+                 list of sizes show a table of the number of disks\n\
+                 and how full they are for each size.\n\
+  -T             Print the time spent in each phase and counters\n\
+                 to stderr.\n\
+  -u             Place files with the same contents only once.\n\
   -v             Print files which are being linked.\n\
+", "\
+  -N pattern     Only fit files with a name matching this pattern,\n\
+                 ignoring case. Given more than once any can match.\n\
+  -M from,until  Only fit files modified from this up to this local\n\
+                 time like 2024-01-31 [12:00[:00]], either can be left\n\
+                 out.\n\
+  -Z min,max     Only fit files with a size in this range.\n\
   path           Path to the files to fit.\n\
-\n";
+\n" };
 
-#define _XOPEN_SOURCE 600
+#define _XOPEN_SOURCE 700
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <dirent.h>
-#include <ftw.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <time.h>
+
+#include "binpack.h"
+#include "filter.h"
+#include "freetree.h"
+#include "hashset.h"
+#include "manifest.h"
+#include "tar.h"
 #include "vector.h"
 #include "utils.h"
 
+enum algorithm { FIRST_FIT, BEST_FIT };
+enum method { LINK, COPY, TAR };
+enum format { HUMAN, NUL, JSON, CSV };
+
+/*
+ * Files are stored as the index of their directory in ctx.dirs and
+ * their name, starting points given on the command line are stored
+ * with WALK_NODIR and their full path as name.
+ */
+struct file {
+	off_t size;
+	off_t cost;			/* what it takes up on a disk */
+	size_t dir;
+	char *name;
+};
+
+DECLARE_VECTOR(file_vector, struct file);
+DEFINE_VECTOR(file_vector, struct file);
+
 static struct context {
 	off_t disk_size;
-	struct vector *files;
+	off_t *disk_sizes;
+	size_t ndisk_sizes;
+	enum algorithm algorithm;
+	enum method method;
+	enum format format;
+
+	/* the files sorted for fitting and apart from them their costs */
+	struct file_vector *files;
+	off_t *sizes;
+	off_t largest;			/* cost with all directories */
+
+	/* what files and directories take up on a disk */
+	off_t block_size;
+	off_t file_overhead;
+	off_t dir_overhead;
+
+	/* per directory its parent, its cost and that of its parents */
+	struct vector *dirs;
+	size_t *parents;
+	off_t *dir_costs;
+	off_t *chain_costs;
+
+	/* the disks of a manifest being extended and their directories */
+	char *extend_path;
+	struct index_vector *fixed_dirs;	/* disk id and dir pairs */
+
+	struct arena *arena;
+	struct filter filter;
+	char *index_path;
+	double optimize;
 	int do_link_files;
 	int do_show_only;
 	int do_recursive_search;
+	int dedup;
 	int verbose;
+
+	/* with a memory limit the files found go to a temporary file */
+	off_t memory_limit;
+	int spill_fd;
+	off_t spill_size;
+	struct run *runs;
+	size_t nruns;
+	struct vector *buffers;		/* of the walker threads */
+	size_t buffer_limit;		/* bytes a walker thread keeps */
+	pthread_mutex_t spill_lock;
 } ctx;
 
-struct file {
-	off_t size;
-	char *name;
+/*
+ * The space a file takes up on a disk, its size rounded up to whole
+ * blocks plus the overhead of a file. With a block size of 0 it is the
+ * space it takes up where it is now.
+ */
+static off_t
+size_cost(off_t size)
+{
+	if (ctx.block_size > 1)
+		size = (size + ctx.block_size - 1) / ctx.block_size *
+		    ctx.block_size;
+
+	return size + ctx.file_overhead;
+}
+
+static off_t
+file_cost(const struct stat *st)
+{
+	if (ctx.block_size == 0)
+		return (off_t)st->st_blocks * 512 + ctx.file_overhead;
+
+	return size_cost(st->st_size);
+}
+
+/* a file as the walk found it, with what it takes to spot duplicates */
+struct found {
+	struct file file;
+	uint64_t dev;
+	uint64_t ino;
+};
+
+static struct found *
+found_new(struct arena *arena, const struct walk_entry *ent)
+{
+	struct found *found;
+
+	found = arena_alloc(arena, sizeof(*found));
+	found->file.name = arena_strdup(arena,
+	    ent->dir == WALK_NODIR ? ent->path : ent->name);
+	found->file.dir = ent->dir;
+	found->file.size = ent->st->st_size;
+	found->file.cost = file_cost(ent->st);
+	found->dev = ent->st->st_dev;
+	found->ino = ent->st->st_ino;
+
+	return found;
+}
+
+/* the space a file of cost in dir takes up on a disk without its dirs */
+static off_t
+dir_need(size_t dir, off_t cost)
+{
+	if (ctx.chain_costs == NULL || dir == WALK_NODIR)
+		return cost;
+
+	return cost + ctx.chain_costs[dir];
+}
+
+static off_t
+file_need(size_t file)
+{
+	return dir_need(ctx.files->items[file].dir, ctx.sizes[file]);
+}
+
+static int
+by_dir_path(const void *dir_a, const void *dir_b)
+{
+	STATS_COUNT(STATS_COMPARES, 1);
+	return strcmp(ctx.dirs->items[*(const size_t *)dir_a],
+	    ctx.dirs->items[*(const size_t *)dir_b]);
+}
+
+static size_t
+components(const char *path)
+{
+	size_t n = 0;
+
+	for (; *path != '\0'; ++path)
+		if (*path != '/' && (path[1] == '/' || path[1] == '\0'))
+			++n;
+
+	return n;
+}
+
+/*
+ * Work out what putting each directory on a disk costs. The parent of
+ * a directory sorts right before its children so going through them
+ * sorted the cost of the parents is known. The directories the walk
+ * started from bring the directories leading up to them along.
+ */
+static void
+count_dirs(void)
+{
+	size_t *sorted, i, ndirs = ctx.dirs->size;
+
+	if (ctx.dir_overhead == 0 || ndirs == 0)
+		return;
+
+	ctx.parents = xcalloc(ndirs, sizeof(ctx.parents[0]));
+	ctx.dir_costs = xcalloc(ndirs, sizeof(ctx.dir_costs[0]));
+	ctx.chain_costs = xcalloc(ndirs, sizeof(ctx.chain_costs[0]));
+
+	sorted = xcalloc(ndirs, sizeof(sorted[0]));
+	for (i = 0; i < ndirs; ++i)
+		sorted[i] = i;
+	qsort(sorted, ndirs, sizeof(sorted[0]), by_dir_path);
+
+	for (i = 0; i < ndirs; ++i) {
+		const char *path = ctx.dirs->items[sorted[i]];
+		const char *slash = strrchr(path, '/');
+		size_t lo = 0, hi = i, dir = sorted[i];
+
+		ctx.parents[dir] = WALK_NODIR;
+		while (slash != NULL && lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			const char *parent = ctx.dirs->items[sorted[mid]];
+			size_t len = slash == path ? 1 : (size_t)(slash - path);
+			int cmp;
+
+			cmp = strncmp(parent, path, len);
+			if (cmp == 0 && parent[len] != '\0')
+				cmp = 1;
+
+			if (cmp == 0) {
+				ctx.parents[dir] = sorted[mid];
+				break;
+			} else if (cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (ctx.parents[dir] == WALK_NODIR) {
+			ctx.dir_costs[dir] = components(path) * ctx.dir_overhead;
+			ctx.chain_costs[dir] = ctx.dir_costs[dir];
+		} else {
+			ctx.dir_costs[dir] = ctx.dir_overhead;
+			ctx.chain_costs[dir] = ctx.dir_overhead +
+			    ctx.chain_costs[ctx.parents[dir]];
+		}
+	}
+
+	xfree(sorted);
+}
+
+/*
+ * Put the full path of the name of len in directory dir in buf,
+ * growing it when needed.
+ */
+static char *
+join_path(size_t dir, const char *name, size_t namelen, char **buf,
+    size_t *bufsize)
+{
+	const char *dirpath = "";
+	size_t len, dirlen = 0;
+
+	if (dir != WALK_NODIR) {
+		dirpath = ctx.dirs->items[dir];
+		dirlen = strlen(dirpath);
+	}
+
+	len = dirlen + namelen + 2;
+	if (len > *bufsize) {
+		*bufsize = len * 2;
+		*buf = xrealloc(*buf, *bufsize);
+	}
+
+	memcpy(*buf, dirpath, dirlen);
+	if (dirlen > 0 && dirpath[dirlen - 1] != '/')
+		(*buf)[dirlen++] = '/';
+	memcpy(*buf + dirlen, name, namelen);
+	(*buf)[dirlen + namelen] = '\0';
+
+	return *buf;
+}
+
+/*
+ * Put the full path of a file in buf, growing it when needed.
+ */
+static char *
+file_path(const struct file *file, char **buf, size_t *bufsize)
+{
+	return join_path(file->dir, file->name, strlen(file->name), buf,
+	    bufsize);
+}
+
+/* the files of a disk are indexes in ctx.files */
+struct disk {
+	struct index_vector *files;
+	off_t free;
+	size_t id;
+};
+
+static struct disk *
+disk_new(off_t size, size_t id)
+{
+	struct disk *disk;
+
+	disk = xcalloc(1, sizeof(*disk));
+	disk->files = index_vector_new();
+	disk->free = size;
+	disk->id = id;
+
+	return disk;
+}
+
+static void
+disk_free(void *disk_ptr)
+{
+	struct disk *disk = disk_ptr;
+
+	index_vector_free(disk->files);
+	xfree(disk);
+}
+
+/* where to print messages, stdout unless a manifest goes there */
+static FILE *
+message_stream(void)
+{
+	return ctx.format == HUMAN ? stdout : stderr;
+}
+
+static void
+hline(int len)
+{
+	while (len-- > 0)
+		putchar('-');
+
+	putchar('\n');
+}
+
+static void
+print_header(struct disk *disk)
+{
+	char header[BUFSIZE], disk_free[NUMBER_BUFSIZE];
+	size_t len;
+
+	len = sprintf(header, "Disk #%lu, %d%% (%s) free:",
+	    (ulong) disk->id, (int)(disk->free * 100 / ctx.disk_size),
+	    format_number(disk_free, disk->free));
+
+	hline(len);
+	printf("%s\n", header);
+	hline(len);
+}
+
+/*
+ * Pretty print a disk and it's contents.
+ */
+static void
+disk_print(struct disk *disk)
+{
+	char *path = NULL;
+	size_t i, pathsize = 0;
+
+	print_header(disk);
+	for (i = 0; i < disk->files->size; ++i) {
+		struct file *file = &ctx.files->items[disk->files->items[i]];
+		char file_size[NUMBER_BUFSIZE];
+
+		printf("%10s %s\n", format_number(file_size, file->size),
+		    file_path(file, &path, &pathsize));
+	}
+
+	putchar('\n');
+	xfree(path);
+}
+
+/* manifests are written to stdout through a buffer of this size */
+#define WRITER_BUFSIZE (1024 * 1024)
+
+struct writer {
+	char *buf;
+	size_t len;
+};
+
+static void
+writer_flush(struct writer *writer)
+{
+	size_t done = 0;
+
+	while (done < writer->len) {
+		ssize_t n;
+
+		n = write(STDOUT_FILENO, writer->buf + done,
+		    writer->len - done);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			die("Can't write manifest:");
+		}
+		done += n;
+	}
+
+	writer->len = 0;
+}
+
+static void
+writer_put(struct writer *writer, const char *str, size_t len)
+{
+	while (len > 0) {
+		size_t n = WRITER_BUFSIZE - writer->len;
+
+		if (n > len)
+			n = len;
+		memcpy(writer->buf + writer->len, str, n);
+		writer->len += n;
+		str += n;
+		len -= n;
+
+		if (writer->len == WRITER_BUFSIZE)
+			writer_flush(writer);
+	}
+}
+
+static void
+writer_putc(struct writer *writer, char c)
+{
+	if (writer->len == WRITER_BUFSIZE)
+		writer_flush(writer);
+	writer->buf[writer->len++] = c;
+}
+
+static void
+writer_number(struct writer *writer, uint64_t n)
+{
+	char digits[20];
+	size_t i = sizeof(digits);
+
+	do
+		digits[--i] = '0' + n % 10;
+	while ((n /= 10) != 0);
+
+	writer_put(writer, digits + i, sizeof(digits) - i);
+}
+
+/* a JSON string, bytes which aren't valid UTF-8 are passed as is */
+static void
+writer_json(struct writer *writer, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	writer_putc(writer, '"');
+	for (; *str != '\0'; ++str) {
+		uchar c = *str;
+
+		if (c == '"' || c == '\\') {
+			writer_putc(writer, '\\');
+			writer_putc(writer, c);
+		} else if (c < 0x20) {
+			writer_put(writer, "\\u00", 4);
+			writer_putc(writer, hex[c >> 4]);
+			writer_putc(writer, hex[c & 0xf]);
+		} else
+			writer_putc(writer, c);
+	}
+	writer_putc(writer, '"');
+}
+
+/* a CSV field, quoted if it has to be */
+static void
+writer_csv(struct writer *writer, const char *str)
+{
+	if (strpbrk(str, ",\"\r\n") == NULL) {
+		writer_put(writer, str, strlen(str));
+		return;
+	}
+
+	writer_putc(writer, '"');
+	for (; *str != '\0'; ++str) {
+		if (*str == '"')
+			writer_putc(writer, '"');
+		writer_putc(writer, *str);
+	}
+	writer_putc(writer, '"');
+}
+
+/*
+ * Write a record of a manifest, with the disk a file is on, its size
+ * in bytes and its path. NUL records have the fields separated by
+ * tabs, JSON lines have an object per line and CSV files start with a
+ * line naming the fields.
+ */
+static void
+write_record(struct writer *writer, size_t disk, off_t size,
+    const char *path)
+{
+	switch (ctx.format) {
+	case NUL:
+		writer_number(writer, disk);
+		writer_putc(writer, '\t');
+		writer_number(writer, size);
+		writer_putc(writer, '\t');
+		writer_put(writer, path, strlen(path) + 1);
+		break;
+	case JSON:
+		writer_put(writer, "{\"disk\":", 8);
+		writer_number(writer, disk);
+		writer_put(writer, ",\"size\":", 8);
+		writer_number(writer, size);
+		writer_put(writer, ",\"path\":", 8);
+		writer_json(writer, path);
+		writer_put(writer, "}\n", 2);
+		break;
+	case CSV:
+		writer_number(writer, disk);
+		writer_putc(writer, ',');
+		writer_number(writer, size);
+		writer_putc(writer, ',');
+		writer_csv(writer, path);
+		writer_putc(writer, '\n');
+		break;
+	case HUMAN:
+		break;
+	}
+}
+
+static void
+writer_open(struct writer *writer)
+{
+	fflush(stdout);
+	writer->buf = xcalloc(1, WRITER_BUFSIZE);
+	writer->len = 0;
+
+	/* what extends a manifest can be appended to it */
+	if (ctx.format == CSV && ctx.extend_path == NULL)
+		writer_put(writer, "disk,size,path\n", 15);
+}
+
+static void
+writer_close(struct writer *writer)
+{
+	writer_flush(writer);
+	xfree(writer->buf);
+}
+
+/* write a manifest of the disks */
+static void
+write_manifest(struct vector *disks)
+{
+	struct writer writer;
+	char *path = NULL;
+	size_t i, j, pathsize = 0;
+
+	writer_open(&writer);
+	for (i = 0; i < disks->size; ++i) {
+		struct disk *disk = disks->items[i];
+
+		for (j = 0; j < disk->files->size; ++j) {
+			struct file *file;
+
+			file = &ctx.files->items[disk->files->items[j]];
+			write_record(&writer, disk->id, file->size,
+			    file_path(file, &path, &pathsize));
+		}
+	}
+
+	writer_close(&writer);
+	xfree(path);
+}
+
+/*
+ * Take the room for a file of cost in dir from the free space of the
+ * disk with id, along with the directories leading up to it the disk
+ * doesn't have yet. The directories a disk has are kept in dirs by the
+ * disk id.
+ */
+static int
+take_room(struct hashset *dirs, size_t id, off_t *free, size_t dir,
+    off_t cost)
+{
+	off_t need = cost;
+
+	if (ctx.dir_costs != NULL) {
+		size_t d;
+
+		for (d = dir; d != WALK_NODIR &&
+		    !hashset_contains(dirs, id, d); d = ctx.parents[d])
+			need += ctx.dir_costs[d];
+	}
+
+	if (*free - need < 0)
+		return FALSE;
+
+	if (ctx.dir_costs != NULL)
+		for (; dir != WALK_NODIR && hashset_add(dirs, id, dir);
+		    dir = ctx.parents[dir])
+			;
+
+	*free -= need;
+
+	return TRUE;
+}
+
+/* put a file on a disk */
+static int
+add_file(struct disk *disk, size_t file, struct hashset *dirs)
+{
+	if (!take_room(dirs, disk->id, &disk->free,
+	    ctx.files->items[file].dir, ctx.sizes[file]))
+		return FALSE;
+
+	*index_vector_push(disk->files) = file;
+
+	return TRUE;
+}
+
+static int
+by_path(const void *file_a, const void *file_b)
+{
+	const struct file *a = file_a;
+	const struct file *b = file_b;
+	int cmp;
+
+	if (a->dir != b->dir) {
+		cmp = strcmp(a->dir == WALK_NODIR ? "" : ctx.dirs->items[a->dir],
+		    b->dir == WALK_NODIR ? "" : ctx.dirs->items[b->dir]);
+		if (cmp != 0)
+			return cmp;
+	}
+
+	return strcmp(a->name, b->name);
+}
+
+/* by_path for the sorts on the main thread, which are counted */
+static int
+by_path_counted(const void *file_a, const void *file_b)
+{
+	STATS_COUNT(STATS_COMPARES, 1);
+	return by_path(file_a, file_b);
+}
+
+/* costs are sorted a byte at a time, the largest first */
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES (64 / RADIX_BITS)
+#define RADIX_KEY(file, pass) \
+	((~(uint64_t)(file)->cost >> ((pass) * RADIX_BITS)) & (RADIX_SIZE - 1))
+
+/*
+ * Sort the files by cost, largest first, with an LSD radix sort. The
+ * counts for every pass are made up front so passes over bytes which
+ * are the same for all files, like the top ones usually are, can be
+ * skipped. Files of the same cost are ordered by path so the layout
+ * doesn't depend on the order in which the walk found them.
+ */
+static void
+sort_files(struct file_vector *files)
+{
+	size_t (*counts)[RADIX_SIZE];
+	struct file *src, *dst, *tmp;
+	size_t i, j;
+	int pass;
+
+	counts = xcalloc(RADIX_PASSES, sizeof(counts[0]));
+	for (i = 0; i < files->size; ++i)
+		for (pass = 0; pass < RADIX_PASSES; ++pass)
+			++counts[pass][RADIX_KEY(&files->items[i], pass)];
+
+	src = files->items;
+	dst = xcalloc(files->capacity, sizeof(files->items[0]));
+	for (pass = 0; pass < RADIX_PASSES; ++pass) {
+		size_t offset = 0;
+
+		if (counts[pass][RADIX_KEY(&src[0], pass)] == files->size)
+			continue;
+
+		for (j = 0; j < RADIX_SIZE; ++j) {
+			size_t count = counts[pass][j];
+
+			counts[pass][j] = offset;
+			offset += count;
+		}
+
+		for (i = 0; i < files->size; ++i)
+			dst[counts[pass][RADIX_KEY(&src[i], pass)]++] = src[i];
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	files->items = src;
+	xfree(dst);
+	xfree(counts);
+
+	for (i = 0; i < files->size; i = j) {
+		for (j = i + 1; j < files->size; ++j)
+			if (files->items[j].cost != files->items[i].cost)
+				break;
+
+		if (j - i > 1)
+			qsort(files->items + i, j - i, sizeof(files->items[0]),
+			    by_path_counted);
+	}
+}
+
+/* drop the items of found which are marked, returns how many there were */
+static size_t
+drop_marked(struct vector *found, const char *drop)
+{
+	size_t i, j;
+
+	for (i = j = 0; i < found->size; ++i)
+		if (!drop[i])
+			found->items[j++] = found->items[i];
+
+	i = found->size - j;
+	found->size = j;
+
+	return i;
+}
+
+/*
+ * Keep only one name of files which are found more than once, through
+ * hard links, overlapping paths or links to directories. The first by
+ * path_cmp is kept, like the walk does for directories, so it doesn't
+ * depend on the order in which the walk found them.
+ */
+static size_t
+drop_hard_links(struct vector *found)
+{
+	struct hashset *inodes;
+	char *path = NULL, *first_path = NULL, *drop;
+	size_t i, dropped, pathsize = 0, first_pathsize = 0;
+
+	inodes = hashset_new();
+	drop = xcalloc(found->size, 1);
+	for (i = 0; i < found->size; ++i) {
+		struct found *file = found->items[i];
+		size_t *first;
+
+		first = hashset_value(inodes, file->dev, file->ino);
+		if (*first == HASHSET_NONE)
+			*first = i;
+		else if (path_cmp(file_path(&file->file, &path, &pathsize),
+		    file_path(&((struct found *)found->items[*first])->file,
+		    &first_path, &first_pathsize)) < 0) {
+			drop[*first] = 1;
+			*first = i;
+		} else
+			drop[i] = 1;
+	}
+
+	dropped = drop_marked(found, drop);
+	hashset_free(inodes);
+	xfree(drop);
+	xfree(path);
+	xfree(first_path);
+
+	return dropped;
+}
+
+/* bytes at the start of files compared first, and read at a time */
+#define DEDUP_HEAD (64 * 1024)
+#define DEDUP_BUFSIZE (64 * 1024)
+
+static uint64_t
+hash_bytes(uint64_t h, const unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t word;
+
+		memcpy(&word, buf + i, sizeof(word));
+		h = (h ^ word) * UINT64_C(0x9e3779b97f4a7c15);
+		h ^= h >> 29;
+	}
+
+	for (; i < len; ++i)
+		h = (h ^ buf[i]) * UINT64_C(0x100000001b3);
+
+	return h;
+}
+
+/* read len bytes unless the file ends first, returns how many it read */
+static size_t
+read_full(int fd, char *buf, size_t len, const char *path)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = read(fd, buf + done, len - done);
+
+		if (n == -1)
+			die("Can't read '%s':", path);
+		if (n == 0)
+			break;
+
+		done += n;
+	}
+
+	return done;
+}
+
+/*
+ * Hash len bytes of a file from offset on.
+ */
+static uint64_t
+hash_file(const char *path, off_t offset, off_t len, char *buf)
+{
+	uint64_t h = UINT64_C(0xcbf29ce484222325);
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || lseek(fd, offset, SEEK_SET) == -1)
+		die("Can't read '%s':", path);
+
+	while (len > 0) {
+		size_t n = len < DEDUP_BUFSIZE ? (size_t)len : DEDUP_BUFSIZE;
+
+		n = read_full(fd, buf, n, path);
+		if (n == 0)
+			break;
+
+		h = hash_bytes(h, (unsigned char *)buf, n);
+		len -= n;
+	}
+
+	close(fd);
+
+	return h;
+}
+
+static int
+same_content(const char *path_a, const char *path_b, char *buf_a,
+    char *buf_b)
+{
+	int fd_a, fd_b, same = TRUE;
+
+	fd_a = open(path_a, O_RDONLY);
+	if (fd_a == -1)
+		die("Can't read '%s':", path_a);
+	fd_b = open(path_b, O_RDONLY);
+	if (fd_b == -1)
+		die("Can't read '%s':", path_b);
+
+	for (;;) {
+		size_t n_a, n_b;
+
+		n_a = read_full(fd_a, buf_a, DEDUP_BUFSIZE, path_a);
+		n_b = read_full(fd_b, buf_b, DEDUP_BUFSIZE, path_b);
+		if (n_a != n_b || memcmp(buf_a, buf_b, n_a) != 0) {
+			same = FALSE;
+			break;
+		}
+
+		if (n_a == 0)
+			break;
+	}
+
+	close(fd_a);
+	close(fd_b);
+
+	return same;
+}
+
+/* a file of a group of the same size and its hash */
+struct member {
+	uint64_t hash;
+	size_t pos;
+};
+
+static int
+by_hash(const void *member_a, const void *member_b)
+{
+	const struct member *a = member_a;
+	const struct member *b = member_b;
+
+	if (a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+
+	return a->pos < b->pos ? -1 : a->pos > b->pos;
+}
+
+static int
+by_size_and_path(const void *found_a, const void *found_b)
+{
+	const struct found *a = *(const struct found *const *)found_a;
+	const struct found *b = *(const struct found *const *)found_b;
+
+	STATS_COUNT(STATS_COMPARES, 1);
+	if (a->file.size != b->file.size)
+		return a->file.size < b->file.size ? -1 : 1;
+
+	return by_path(&a->file, &b->file);
+}
+
+struct dedup {
+	pthread_mutex_t lock;
+	size_t next;
+	struct vector *found;
+	char *drop;
+};
+
+/* the buffers of a dedup thread */
+struct dedup_buffers {
+	char *a;
+	char *b;
+	char *path_a;
+	char *path_b;
+	size_t path_a_size;
+	size_t path_b_size;
+};
+
+static const char *
+member_path(struct dedup *dedup, const struct member *member, char **buf,
+    size_t *bufsize)
+{
+	struct found *found = dedup->found->items[member->pos];
+
+	return file_path(&found->file, buf, bufsize);
+}
+
+/*
+ * Within files of the same size and hash, which are in path order,
+ * drop the files which are the same as one before them.
+ */
+static void
+dedup_run(struct dedup *dedup, struct member *run, size_t n,
+    struct dedup_buffers *buf)
+{
+	size_t i, j;
+
+	for (i = 1; i < n; ++i) {
+		for (j = 0; j < i; ++j) {
+			if (dedup->drop[run[j].pos])
+				continue;
+
+			if (same_content(member_path(dedup, &run[i], &buf->path_a,
+			    &buf->path_a_size), member_path(dedup, &run[j],
+			    &buf->path_b, &buf->path_b_size), buf->a, buf->b)) {
+				dedup->drop[run[i].pos] = 1;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Hash the start of files of the same size, and the rest of those of
+ * which it matched, before comparing what is left byte by byte.
+ */
+static void
+dedup_group(struct dedup *dedup, size_t first, size_t n,
+    struct dedup_buffers *buf)
+{
+	off_t size = ((struct found *)dedup->found->items[first])->file.size;
+	struct member *members;
+	size_t i, j, k;
+
+	members = xcalloc(n, sizeof(members[0]));
+	for (i = 0; i < n; ++i) {
+		members[i].pos = first + i;
+		members[i].hash = hash_file(member_path(dedup, &members[i],
+		    &buf->path_a, &buf->path_a_size), 0, DEDUP_HEAD, buf->a);
+	}
+	qsort(members, n, sizeof(members[0]), by_hash);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n; ++j)
+			if (members[j].hash != members[i].hash)
+				break;
+
+		if (j - i < 2)
+			continue;
+
+		if (size > DEDUP_HEAD) {
+			for (k = i; k < j; ++k)
+				members[k].hash = hash_file(member_path(dedup,
+				    &members[k], &buf->path_a,
+				    &buf->path_a_size), DEDUP_HEAD,
+				    size - DEDUP_HEAD, buf->a);
+			qsort(members + i, j - i, sizeof(members[0]), by_hash);
+		}
+
+		for (k = i; k < j; ) {
+			size_t end;
+
+			for (end = k + 1; end < j; ++end)
+				if (members[end].hash != members[k].hash)
+					break;
+
+			dedup_run(dedup, members + k, end - k, buf);
+			k = end;
+		}
+	}
+
+	xfree(members);
+}
+
+static void *
+dedup_worker(void *dedup_ptr)
+{
+	struct dedup *dedup = dedup_ptr;
+	struct dedup_buffers buf;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.a = xcalloc(1, DEDUP_BUFSIZE);
+	buf.b = xcalloc(1, DEDUP_BUFSIZE);
+
+	for (;;) {
+		size_t first, end;
+		off_t size;
+
+		/* take the next group of files of the same size */
+		pthread_mutex_lock(&dedup->lock);
+		first = end = dedup->next;
+		if (first < dedup->found->size) {
+			size = ((struct found *)
+			    dedup->found->items[first])->file.size;
+			while (end < dedup->found->size &&
+			    ((struct found *)
+			    dedup->found->items[end])->file.size == size)
+				++end;
+		}
+		dedup->next = end;
+		pthread_mutex_unlock(&dedup->lock);
+
+		if (first >= dedup->found->size)
+			break;
+
+		size = ((struct found *)dedup->found->items[first])->file.size;
+		if (end - first > 1 && size > 0)
+			dedup_group(dedup, first, end - first, &buf);
+	}
+
+	xfree(buf.a);
+	xfree(buf.b);
+	xfree(buf.path_a);
+	xfree(buf.path_b);
+
+	return NULL;
+}
+
+/*
+ * Keep only one of the files with the same contents, a thread per cpu
+ * looks at the files of one size at a time. Empty files are kept.
+ */
+static size_t
+drop_duplicates(struct vector *found)
+{
+	struct dedup dedup;
+	pthread_t *threads;
+	size_t dropped;
+	int n, nthreads;
+
+	qsort(found->items, found->size, sizeof(found->items[0]),
+	    by_size_and_path);
+
+	pthread_mutex_init(&dedup.lock, NULL);
+	dedup.next = 0;
+	dedup.found = found;
+	dedup.drop = xcalloc(found->size, 1);
+
+	nthreads = cpu_count();
+	threads = xcalloc(nthreads, sizeof(threads[0]));
+	for (n = 0; n < nthreads; ++n)
+		if (pthread_create(&threads[n], NULL, dedup_worker,
+		    &dedup) != 0)
+			die("Can't create dedup thread.");
+
+	for (n = 0; n < nthreads; ++n)
+		pthread_join(threads[n], NULL);
+
+	dropped = drop_marked(found, dedup.drop);
+
+	pthread_mutex_destroy(&dedup.lock);
+	xfree(dedup.drop);
+	xfree(threads);
+
+	return dropped;
+}
+
+static int
+by_record_path(const void *record_a, const void *record_b)
+{
+	const struct manifest_record *a, *b;
+
+	a = *(const struct manifest_record *const *)record_a;
+	b = *(const struct manifest_record *const *)record_b;
+
+	return strcmp(a->path, b->path);
+}
+
+static int
+by_record_disk(const void *record_a, const void *record_b)
+{
+	const struct manifest_record *a, *b;
+
+	a = *(const struct manifest_record *const *)record_a;
+	b = *(const struct manifest_record *const *)record_b;
+
+	if (a->disk != b->disk)
+		return a->disk < b->disk ? -1 : 1;
+
+	return strcmp(a->path, b->path);
+}
+
+/* drop the files found which are in the manifest already */
+static size_t
+drop_placed(struct vector *found, struct vector *records)
+{
+	struct manifest_record key, *keyp = &key;
+	char *drop, *path = NULL;
+	size_t i, dropped, pathsize = 0;
+
+	qsort(records->items, records->size, sizeof(records->items[0]),
+	    by_record_path);
+
+	drop = xcalloc(found->size, 1);
+	for (i = 0; i < found->size; ++i) {
+		key.path = file_path(&((struct found *)found->items[i])->file,
+		    &path, &pathsize);
+		drop[i] = bsearch(&keyp, records->items, records->size,
+		    sizeof(records->items[0]), by_record_path) != NULL;
+	}
+
+	dropped = drop_marked(found, drop);
+	xfree(drop);
+	xfree(path);
+
+	return dropped;
+}
+
+/* the directory found by the walk with the path of len, or WALK_NODIR */
+static size_t
+find_dir(const size_t *sorted, const char *path, size_t len)
+{
+	size_t lo = 0, hi = ctx.dirs->size;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const char *dir = ctx.dirs->items[sorted[mid]];
+		int cmp;
+
+		cmp = strncmp(dir, path, len);
+		if (cmp == 0 && dir[len] != '\0')
+			cmp = 1;
+
+		if (cmp == 0)
+			return sorted[mid];
+		else if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return WALK_NODIR;
+}
+
+/*
+ * Make the disks of the manifest being extended, with the room their
+ * files and directories leave. Files count with their size rounded up
+ * to blocks, with a block size of 0 with just their size. A disk
+ * looking fuller than it can be, like with other overheads, is full.
+ *
+ * With the records sorted by path the directories a file shares with
+ * the file before it are those of their common prefix. Directories
+ * the walk found are noted so files put in them aren't counted for
+ * them again.
+ */
+static struct vector *
+fixed_disks(struct vector *records)
+{
+	struct manifest_record *prev = NULL;
+	struct vector *disks;
+	struct disk *disk = NULL;
+	size_t *sorted = NULL, i;
+
+	qsort(records->items, records->size, sizeof(records->items[0]),
+	    by_record_disk);
+
+	if (ctx.dir_overhead > 0) {
+		sorted = xcalloc(ctx.dirs->size + 1, sizeof(sorted[0]));
+		for (i = 0; i < ctx.dirs->size; ++i)
+			sorted[i] = i;
+		qsort(sorted, ctx.dirs->size, sizeof(sorted[0]), by_dir_path);
+		ctx.fixed_dirs = index_vector_new();
+	}
+
+	disks = vector_new();
+	for (i = 0; i < records->size; ++i) {
+		struct manifest_record *record = records->items[i];
+		const char *path = record->path;
+		size_t common = 0, s;
+
+		if (disk == NULL || disk->id != record->disk) {
+			disk = disk_new(ctx.disk_size, record->disk);
+			vector_add(disks, disk);
+			prev = NULL;
+		}
+
+		disk->free -= size_cost(record->size);
+		if (sorted == NULL)
+			continue;
+
+		if (prev != NULL)
+			while (path[common] != '\0' &&
+			    path[common] == prev->path[common])
+				++common;
+
+		for (s = 1; path[s] != '\0'; ++s) {
+			size_t dir;
+
+			if (path[s] != '/' || path[s - 1] == '/')
+				continue;
+			if (s <= common && prev->path[s] == '/')
+				continue;
+
+			disk->free -= ctx.dir_overhead;
+			dir = find_dir(sorted, path, s);
+			if (dir != WALK_NODIR) {
+				*index_vector_push(ctx.fixed_dirs) = disk->id;
+				*index_vector_push(ctx.fixed_dirs) = dir;
+			}
+		}
+		prev = record;
+	}
+
+	for (i = 0; i < disks->size; ++i) {
+		disk = disks->items[i];
+		if (disk->free < 0)
+			disk->free = 0;
+	}
+
+	xfree(sorted);
+
+	return disks;
+}
+
+/*
+ * Fits files onto disks following a simple algorithm; with the files
+ * sorted by size descending look up a disk which can hold the file. With
+ * first fit this is the first disk with enough room, with best fit the
+ * disk with the least room left. If none can hold the file create a new
+ * disk containing it. This will rapidly fill disks while the smaller
+ * remaining files will usually make a good final fit.
+ *
+ * The disks are kept in a free space index so the lookup does not have
+ * to scan every disk for every file. It looks for room for the file
+ * and all of its directories, even if a disk has some of them already.
+ * Only the disks are written to so several fits over the same files
+ * can run at the same time.
+ *
+ * Disks which are in disks already, those of a manifest being
+ * extended, are indexed with the room they have left so the gaps in
+ * them are filled before new disks are made.
+ */
+static void
+fit(struct vector *disks, off_t disk_size)
+{
+	struct freetree *index;
+	struct hashset *dirs;
+	size_t i;
+
+	index = freetree_new();
+	dirs = hashset_new();
+	for (i = 0; i < disks->size; ++i)
+		freetree_add(index, ((struct disk *)disks->items[i])->free);
+	if (ctx.fixed_dirs != NULL)
+		for (i = 0; i + 1 < ctx.fixed_dirs->size; i += 2)
+			hashset_add(dirs, ctx.fixed_dirs->items[i],
+			    ctx.fixed_dirs->items[i + 1]);
+
+	for (i = 0; i < ctx.files->size; ++i) {
+		struct disk *disk;
+		size_t j;
+
+		if (ctx.algorithm == BEST_FIT)
+			j = freetree_best_fit(index, file_need(i));
+		else
+			j = freetree_first_fit(index, file_need(i));
+
+		if (j == FREETREE_NONE) {
+			size_t id = 1;
+
+			if (disks->size > 0)
+				id = ((struct disk *)
+				    disks->items[disks->size - 1])->id + 1;
+			disk = disk_new(disk_size, id);
+			vector_add(disks, disk);
+			j = freetree_add(index, disk->free);
+		}
+
+		disk = disks->items[j];
+		if (!add_file(disk, i, dirs))
+			die("add_file failed.");
+
+		freetree_set(index, j, disk->free);
+	}
+
+	/* a fit runs on a thread of its own for a plan */
+	stats_add(STATS_PROBES, index->probes);
+	freetree_free(index);
+	hashset_free(dirs);
+}
+
+/*
+ * Look for a packing on fewer disks than the fit made, for up to
+ * ctx.optimize seconds, and rebuild the disks from it. The search
+ * counts all directories of a file with every file so whatever it
+ * comes up with fits.
+ */
+static void
+optimize(struct vector *disks)
+{
+	size_t *bin_of, i, j, nbins, bound;
+	struct hashset *dirs;
+	off_t *needs;
+
+	bin_of = xcalloc(ctx.files->size, sizeof(bin_of[0]));
+	for (i = 0; i < disks->size; ++i) {
+		struct disk *disk = disks->items[i];
+
+		for (j = 0; j < disk->files->size; ++j)
+			bin_of[disk->files->items[j]] = i;
+	}
+
+	needs = xcalloc(ctx.files->size, sizeof(needs[0]));
+	for (i = 0; i < ctx.files->size; ++i)
+		needs[i] = file_need(i);
+
+	bound = binpack_lower_bound(ctx.sizes, ctx.files->size,
+	    ctx.disk_size);
+	nbins = binpack_improve(needs, ctx.files->size, ctx.disk_size,
+	    bin_of, disks->size, bound, ctx.optimize);
+	xfree(needs);
+
+	fprintf(message_stream(),
+	    "Optimized from %lu to %lu disks, at least %lu needed.\n",
+	    (ulong) disks->size, (ulong) nbins, (ulong) bound);
+
+	if (nbins == disks->size) {
+		xfree(bin_of);
+		return;
+	}
+
+	vector_foreach(disks, disk_free);
+	disks->size = 0;
+	for (i = 0; i < nbins; ++i)
+		vector_add(disks, disk_new(ctx.disk_size, i + 1));
+
+	dirs = hashset_new();
+	for (i = 0; i < ctx.files->size; ++i)
+		if (!add_file(disks->items[bin_of[i]], i, dirs))
+			die("add_file failed.");
+
+	hashset_free(dirs);
+	xfree(bin_of);
+}
+
+/* the result of fitting the files on disks of one size */
+struct plan {
+	off_t disk_size;
+	struct vector *disks;
+	int fits;
+};
+
+struct planner {
+	pthread_mutex_t lock;
+	size_t next;
+	struct plan *plans;
+};
+
+static void *
+plan_worker(void *planner_ptr)
+{
+	struct planner *planner = planner_ptr;
+
+	for (;;) {
+		struct plan *plan;
+		size_t i;
+
+		pthread_mutex_lock(&planner->lock);
+		i = planner->next++;
+		pthread_mutex_unlock(&planner->lock);
+
+		if (i >= ctx.ndisk_sizes)
+			break;
+
+		plan = &planner->plans[i];
+		plan->disks = vector_new();
+		plan->fits = ctx.largest <= plan->disk_size;
+		if (plan->fits)
+			fit(plan->disks, plan->disk_size);
+	}
+
+	return NULL;
+}
+
+/*
+ * Fit the sorted files on each of the disk sizes, a thread per cpu,
+ * and print how many disks it takes and how full they are.
+ */
+static void
+plan(void)
+{
+	struct planner planner;
+	pthread_t *threads;
+	off_t total = 0;
+	size_t i;
+	int n, nthreads;
+
+	for (i = 0; i < ctx.files->size; ++i)
+		total += ctx.sizes[i];
+
+	pthread_mutex_init(&planner.lock, NULL);
+	planner.next = 0;
+	planner.plans = xcalloc(ctx.ndisk_sizes, sizeof(planner.plans[0]));
+	for (i = 0; i < ctx.ndisk_sizes; ++i)
+		planner.plans[i].disk_size = ctx.disk_sizes[i];
+
+	nthreads = cpu_count();
+	if ((size_t)nthreads > ctx.ndisk_sizes)
+		nthreads = ctx.ndisk_sizes;
+
+	threads = xcalloc(nthreads, sizeof(threads[0]));
+	for (n = 0; n < nthreads; ++n)
+		if (pthread_create(&threads[n], NULL, plan_worker,
+		    &planner) != 0)
+			die("Can't create plan thread.");
+
+	for (n = 0; n < nthreads; ++n)
+		pthread_join(threads[n], NULL);
+
+	printf("%10s %6s %6s %10s\n", "size", "disks", "fill", "last free");
+	for (i = 0; i < ctx.ndisk_sizes; ++i) {
+		struct plan *plan = &planner.plans[i];
+		char *disk_size, *last_free;
+		struct disk *last;
+
+		disk_size = number_to_string(plan->disk_size);
+		if (!plan->fits) {
+			printf("%10s %6s %6s %10s\n", disk_size, "-", "-", "-");
+			xfree(disk_size);
+			continue;
+		}
+
+		last = plan->disks->items[plan->disks->size - 1];
+		last_free = number_to_string(last->free);
+		printf("%10s %6lu %5d%% %10s\n", disk_size,
+		    (ulong) plan->disks->size,
+		    (int)(total / plan->disks->size * 100 / plan->disk_size),
+		    last_free);
+		xfree(last_free);
+		xfree(disk_size);
+
+		vector_foreach(plan->disks, disk_free);
+		vector_free(plan->disks);
+	}
+
+	pthread_mutex_destroy(&planner.lock);
+	xfree(planner.plans);
+	xfree(threads);
+}
+
+/* the length of the leading directories path and made have in common */
+static size_t
+common_dirs(const char *path, const char *made)
+{
+	size_t i, len = 0;
+
+	for (i = 0; path[i] != '\0' && path[i] == made[i]; ++i)
+		if (path[i] == '/')
+			len = i + 1;
+
+	/* all of made is a directory as well */
+	if (made[i] == '\0' && (path[i] == '/' || path[i] == '\0'))
+		len = i;
+
+	return len;
+}
+
+/*
+ * Where a disk goes, a directory to link or copy files into or a tar
+ * archive.
+ */
+struct output {
+	const char *dest;
+	int disk_fd;
+	struct tar *tar;
+	struct stat dir_st;		/* how directories are archived */
+};
+
+/*
+ * Make the directories of a path relative to the disk, skipping those
+ * the path has in common with made which are there already.
+ */
+static void
+make_directories_at(struct output *out, char *path, const char *made)
+{
+	char *slash = path + common_dirs(path, made);
+
+	while (*slash != '\0') {
+		char c;
+
+		while (*slash == '/')
+			++slash;
+		while (*slash != '/' && *slash != '\0')
+			++slash;
+
+		c = *slash;
+		*slash = '\0';
+		if (out->tar != NULL)
+			tar_add_dir(out->tar, path, &out->dir_st);
+		else if (mkdirat(out->disk_fd, path, 0700) == -1 &&
+		    errno != EEXIST)
+			die("Can't make directory '%s':", path);
+		*slash = c;
+	}
+}
+
+/* the directory a file goes to on a disk, relative to the disk */
+static const char *
+dest_dir(const struct file *file, size_t *len)
+{
+	const char *dir;
+	size_t skip;
+
+	if (file->dir == WALK_NODIR) {
+		const char *slash = strrchr(file->name, '/');
+
+		dir = file->name;
+		*len = slash == NULL ? 0 : (size_t)(slash - dir);
+	} else {
+		dir = ctx.dirs->items[file->dir];
+		*len = strlen(dir);
+	}
+
+	for (skip = 0; skip < *len && dir[skip] == '/'; ++skip)
+		;
+	*len -= skip;
+
+	return dir + skip;
+}
+
+/* the name of a file in dest_dir */
+static const char *
+dest_name(const struct file *file)
+{
+	const char *slash;
+
+	if (file->dir != WALK_NODIR ||
+	    (slash = strrchr(file->name, '/')) == NULL)
+		return file->name;
+
+	return slash + 1;
+}
+
+/*
+ * Order the files of a disk by the directory they go to and then by
+ * name. Directories are compared a component at a time, as if a slash
+ * sorts before anything else, so a directory is followed by all of its
+ * subdirectories and each directory only has to be made once.
+ */
+static int
+by_file_path(const void *file_a, const void *file_b)
+{
+	const struct file *a = &ctx.files->items[*(const size_t *)file_a];
+	const struct file *b = &ctx.files->items[*(const size_t *)file_b];
+	const char *dir_a, *dir_b;
+	size_t i, len_a, len_b;
+
+	dir_a = dest_dir(a, &len_a);
+	dir_b = dest_dir(b, &len_b);
+	for (i = 0; i < len_a && i < len_b && dir_a[i] == dir_b[i]; ++i)
+		;
+
+	if (i < len_a && i < len_b) {
+		if (dir_a[i] == '/')
+			return -1;
+		if (dir_b[i] == '/')
+			return 1;
+		return (uchar)dir_a[i] - (uchar)dir_b[i];
+	}
+	if (len_a != len_b)
+		return len_a < len_b ? -1 : 1;
+
+	return strcmp(dest_name(a), dest_name(b));
+}
+
+/*
+ * Put the file src relative to src_fd on the disk as dst relative to
+ * dst_fd, name is its path on the disk.
+ */
+static void
+output_file(struct output *out, int src_fd, const char *src, int dst_fd,
+    const char *dst, const char *name)
+{
+	struct stat st;
+	int fd;
+
+	switch (ctx.method) {
+	case LINK:
+		if (linkat(src_fd, src, dst_fd, dst, 0) == -1)
+			die("Can't link '%s' to '%s/%s':", src, out->dest, name);
+		break;
+	case COPY:
+		if (!copy_file_at(src_fd, src, dst_fd, dst))
+			die("Can't copy '%s' to '%s/%s':", src, out->dest, name);
+		break;
+	case TAR:
+		fd = openat(src_fd, src, O_RDONLY);
+		if (fd == -1 || fstat(fd, &st) == -1)
+			die("Can't open '%s':", src);
+		if (!S_ISREG(st.st_mode))
+			die("'%s' is not a regular file.", src);
+
+		tar_add_file(out->tar, fd, name, &st);
+		close(fd);
+		break;
+	}
+}
+
+/*
+ * Put the contents of a disk in its output. The files go a directory
+ * at a time, the source and destination directory are opened once and
+ * the files are placed by name.
+ */
+static void
+link_disk(struct disk *disk, struct output *out)
+{
+	char *made, *path = NULL, *name = NULL;
+	size_t i, pathsize = 0, dir = WALK_NODIR, *files;
+	int src_fd = -1, dst_fd = -1;
+
+	made = xstrdup("");
+	files = xcalloc(disk->files->size, sizeof(files[0]));
+	memcpy(files, disk->files->items, disk->files->size * sizeof(files[0]));
+	qsort(files, disk->files->size, sizeof(files[0]), by_file_path);
+
+	for (i = 0; i < disk->files->size; ++i) {
+		struct file *file = &ctx.files->items[files[i]];
+		char *dest;
+
+		/* starting points get placed by their whole path */
+		if (file->dir == WALK_NODIR) {
+			char *slash;
+
+			dest = xstrdup(file->name + strspn(file->name, "/"));
+			slash = strrchr(dest, '/');
+			if (slash != NULL) {
+				*slash = '\0';
+				make_directories_at(out, dest, made);
+				xfree(made);
+				made = xstrdup(dest);
+				*slash = '/';
+			}
+
+			output_file(out, AT_FDCWD, file->name, out->disk_fd,
+			    dest, dest);
+			xfree(dest);
+		} else {
+			if (file->dir != dir) {
+				const char *src = ctx.dirs->items[file->dir];
+
+				if (src_fd != -1)
+					close(src_fd);
+				if (dst_fd != -1)
+					close(dst_fd);
+
+				dir = file->dir;
+				dest = xstrdup(src + strspn(src, "/"));
+				make_directories_at(out, dest, made);
+				xfree(made);
+				made = dest;
+
+				src_fd = open(src, O_RDONLY);
+				if (src_fd == -1)
+					die("Can't open '%s':", src);
+
+				if (out->tar == NULL) {
+					dst_fd = openat(out->disk_fd,
+					    dest[0] != '\0' ? dest : ".",
+					    O_RDONLY);
+					if (dst_fd == -1)
+						die("Can't open '%s/%s':",
+						    out->dest, dest);
+				}
+			}
+
+			name = xrealloc(name, strlen(made) +
+			    strlen(file->name) + 2);
+			sprintf(name, "%s%s%s", made, made[0] != '\0' ? "/" : "",
+			    file->name);
+			output_file(out, src_fd, file->name, dst_fd, file->name,
+			    name);
+		}
+
+		if (ctx.verbose)
+			fprintf(message_stream(), "%s -> %s\n",
+			    file_path(file, &path, &pathsize), out->dest);
+	}
+
+	if (src_fd != -1)
+		close(src_fd);
+	if (dst_fd != -1)
+		close(dst_fd);
+
+	xfree(files);
+	xfree(made);
+	xfree(name);
+	xfree(path);
+}
+
+struct linker {
+	pthread_mutex_t lock;
+	size_t next;
+	struct vector *disks;
+	const char *basedir;
 };
 
-static struct file *
-file_new(const char *name, off_t size)
+static void *
+link_worker(void *linker_ptr)
 {
-	struct file *file;
+	struct linker *linker = linker_ptr;
+	struct output out;
+	char *dest;
+
+	memset(&out, 0, sizeof(out));
+	out.dir_st.st_mode = S_IFDIR | 0700;
+	out.dir_st.st_uid = getuid();
+	out.dir_st.st_gid = getgid();
+	out.dir_st.st_mtime = time(NULL);
+
+	dest = xcalloc(1, strlen(linker->basedir) + 32);
+	for (;;) {
+		struct disk *disk;
+		size_t i;
+
+		pthread_mutex_lock(&linker->lock);
+		i = linker->next++;
+		pthread_mutex_unlock(&linker->lock);
+
+		if (i >= linker->disks->size)
+			break;
 
-	file = xcalloc(1, sizeof(*file));
-	file->name = xstrdup(name);
-	file->size = size;
+		disk = linker->disks->items[i];
+		out.dest = dest;
+		if (ctx.method == TAR) {
+			sprintf(dest, "%s/%04lu.tar", linker->basedir,
+			    (ulong) disk->id);
+			out.disk_fd = -1;
+			out.tar = tar_open(dest);
+			link_disk(disk, &out);
+			tar_close(out.tar);
+			out.tar = NULL;
+		} else {
+			sprintf(dest, "%s/%04lu", linker->basedir,
+			    (ulong) disk->id);
+			xmkdir(dest, 0700);
+			out.disk_fd = open(dest, O_RDONLY);
+			if (out.disk_fd == -1)
+				die("Can't open '%s':", dest);
+			link_disk(disk, &out);
+			close(out.disk_fd);
+		}
+	}
 
-	return file;
+	xfree(dest);
+
+	return NULL;
 }
 
+/*
+ * Link or copy the disks to numbered directories in basedir, or write
+ * them to numbered tar archives in it. A thread per cpu takes a disk
+ * at a time, so every file is read once.
+ */
 static void
-file_free(void *file_ptr)
+link_disks(struct vector *disks, char *basedir)
 {
-	struct file *file = file_ptr;
+	struct linker linker;
+	pthread_t *threads;
+	int n, nthreads;
+
+	make_directories(basedir);
+
+	pthread_mutex_init(&linker.lock, NULL);
+	linker.next = 0;
+	linker.disks = disks;
+	linker.basedir = basedir;
+
+	nthreads = cpu_count();
+	if ((size_t)nthreads > disks->size)
+		nthreads = disks->size;
 
-	xfree(file->name);
-	xfree(file);
+	threads = xcalloc(nthreads, sizeof(threads[0]));
+	for (n = 0; n < nthreads; ++n)
+		if (pthread_create(&threads[n], NULL, link_worker,
+		    &linker) != 0)
+			die("Can't create link thread.");
+
+	for (n = 0; n < nthreads; ++n)
+		pthread_join(threads[n], NULL);
+
+	pthread_mutex_destroy(&linker.lock);
+	xfree(threads);
 }
 
-struct disk {
-	struct vector *files;
-	off_t free;
-	size_t id;
+/*
+ * With a memory limit the files found are not kept in memory but are
+ * spilled to a temporary file by each walker thread, in runs sorted
+ * the way files are fitted. The runs are merged and the files are
+ * placed as they come out of the merge. The records of a disk are
+ * written once it can't take the smallest file, or earlier when the
+ * records waiting to be written take up too much memory, so records
+ * of a disk can end up in more than one place in the manifest. The
+ * directories are kept in memory as usual.
+ *
+ * Files of the same cost are fitted by device and inode, which puts
+ * the names of a file found more than once next to each other.
+ */
+
+/* a file in a run, followed by its name */
+struct spill_header {
+	uint64_t cost;
+	uint64_t size;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t dir;
+	uint64_t namelen;
 };
 
-static struct disk *
-disk_new(off_t size)
+/* a file waiting in the buffer of a walker thread */
+struct spilled {
+	struct spill_header header;
+	const char *name;
+};
+
+/* the files a walker thread found since it last wrote a run */
+struct spill_buffer {
+	struct vector *items;
+	struct arena *arena;
+	size_t bytes;
+	uint64_t count;
+	off_t min_cost;			/* -1 if none yet */
+	off_t *dir_max;			/* largest cost per directory, or -1 */
+	size_t ndirs;
+};
+
+struct run {
+	off_t pos;
+	off_t len;
+};
+
+/* runs are written and read through buffers of this size at least */
+#define RUN_BUFSIZE (64 * 1024)
+
+/* the most runs merged at once */
+#define MERGE_FANIN 64
+
+static void
+spill_open(void)
 {
-	struct disk *disk;
-	static size_t id;
+	const char *tmpdir = getenv("TMPDIR");
+	char *path;
+
+	if (tmpdir == NULL || tmpdir[0] == '\0')
+		tmpdir = "/tmp";
+
+	path = xcalloc(1, strlen(tmpdir) + 16);
+	sprintf(path, "%s/fit.XXXXXX", tmpdir);
+	ctx.spill_fd = mkstemp(path);
+	if (ctx.spill_fd == -1)
+		die("Can't create a temporary file in '%s':", tmpdir);
+
+	/* it goes away when we do */
+	unlink(path);
+	xfree(path);
+
+	ctx.buffers = vector_new();
+	ctx.buffer_limit = ctx.memory_limit / 2 / cpu_count();
+	if (ctx.buffer_limit < ARENA_BLOCK_SIZE * 4)
+		ctx.buffer_limit = ARENA_BLOCK_SIZE * 4;
+	pthread_mutex_init(&ctx.spill_lock, NULL);
+}
 
-	disk = xcalloc(1, sizeof(*disk));
-	disk->files = vector_new();
-	disk->free = size;
-	disk->id = ++id;
+static int
+spill_order(const struct spill_header *a, const struct spill_header *b)
+{
+	if (a->cost != b->cost)
+		return a->cost > b->cost ? -1 : 1;
+	if (a->dev != b->dev)
+		return a->dev < b->dev ? -1 : 1;
+	if (a->ino != b->ino)
+		return a->ino < b->ino ? -1 : 1;
 
-	return disk;
+	return 0;
 }
 
-static void
-disk_free(void *disk_ptr)
+static int
+by_spill(const void *spilled_a, const void *spilled_b)
 {
-	struct disk *disk = disk_ptr;
+	const struct spilled *a = *(const struct spilled *const *)spilled_a;
+	const struct spilled *b = *(const struct spilled *const *)spilled_b;
 
-	vector_foreach(disk->files, file_free);
-	vector_free(disk->files);
-	xfree(disk);
+	return spill_order(&a->header, &b->header);
 }
 
+struct run_writer {
+	off_t pos;
+	char *buf;
+	size_t len;
+};
+
 static void
-hline(int len)
+run_flush(struct run_writer *writer)
 {
-	while (len-- > 0)
-		putchar('-');
+	size_t done = 0;
 
-	putchar('\n');
+	while (done < writer->len) {
+		ssize_t n;
+
+		n = pwrite(ctx.spill_fd, writer->buf + done,
+		    writer->len - done, writer->pos);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			die("Can't write temporary file:");
+		}
+		done += n;
+		writer->pos += n;
+	}
+
+	writer->len = 0;
 }
 
 static void
-print_header(struct disk *disk)
+run_write(struct run_writer *writer, const void *data, size_t len)
 {
-	char header[BUFSIZE];
-	char *disk_free;
-	size_t len;
+	const char *p = data;
 
-	disk_free = number_to_string(disk->free);
-	len = sprintf(header, "Disk #%lu, %d%% (%s) free:",
-	    (ulong) disk->id,
-	    (int)(disk->free * 100 / ctx.disk_size), disk_free);
-	xfree(disk_free);
+	while (len > 0) {
+		size_t n = RUN_BUFSIZE - writer->len;
 
-	hline(len);
-	printf("%s\n", header);
-	hline(len);
+		if (n > len)
+			n = len;
+		memcpy(writer->buf + writer->len, p, n);
+		writer->len += n;
+		p += n;
+		len -= n;
+
+		if (writer->len == RUN_BUFSIZE)
+			run_flush(writer);
+	}
 }
 
 /*
- * Pretty print a disk and it's contents.
+ * Add a run of len bytes at the end of the temporary file, returns
+ * where it starts.
  */
+static off_t
+add_run(off_t len)
+{
+	off_t pos;
+
+	pthread_mutex_lock(&ctx.spill_lock);
+	pos = ctx.spill_size;
+	ctx.spill_size += len;
+	ctx.runs = xrealloc(ctx.runs, (ctx.nruns + 1) * sizeof(ctx.runs[0]));
+	ctx.runs[ctx.nruns].pos = pos;
+	ctx.runs[ctx.nruns].len = len;
+	++ctx.nruns;
+	pthread_mutex_unlock(&ctx.spill_lock);
+
+	return pos;
+}
+
+/* sort the files of a buffer and write them as a run */
 static void
-disk_print(struct disk *disk)
+spill_run(struct spill_buffer *buffer)
 {
+	struct run_writer writer;
+	off_t len = 0;
 	size_t i;
 
-	print_header(disk);
-	for (i = 0; i < disk->files->size; ++i) {
-		struct file *file = disk->files->items[i];
-		char *file_size;
+	if (buffer->items->size == 0)
+		return;
+
+	qsort(buffer->items->items, buffer->items->size,
+	    sizeof(buffer->items->items[0]), by_spill);
+
+	for (i = 0; i < buffer->items->size; ++i) {
+		struct spilled *file = buffer->items->items[i];
 
-		file_size = number_to_string(file->size);
-		printf("%10s %s\n", file_size, file->name);
-		xfree(file_size);
+		len += sizeof(file->header) + file->header.namelen;
 	}
 
-	putchar('\n');
+	writer.pos = add_run(len);
+	writer.buf = xcalloc(1, RUN_BUFSIZE);
+	writer.len = 0;
+	for (i = 0; i < buffer->items->size; ++i) {
+		struct spilled *file = buffer->items->items[i];
+
+		run_write(&writer, &file->header, sizeof(file->header));
+		run_write(&writer, file->name, file->header.namelen);
+	}
+	run_flush(&writer);
+	xfree(writer.buf);
+
+	buffer->items->size = 0;
+	buffer->bytes = 0;
+	arena_free(buffer->arena);
+	buffer->arena = arena_new();
+}
+
+/* keep a file the walk found in the buffer of its thread */
+static void
+spill_file(struct walk_out *out, const struct walk_entry *ent)
+{
+	struct spill_buffer *buffer = out->data;
+	struct spilled *file;
+	const char *name;
+	size_t namelen;
+
+	if (buffer == NULL) {
+		buffer = xcalloc(1, sizeof(*buffer));
+		buffer->items = vector_new();
+		buffer->arena = arena_new();
+		buffer->min_cost = -1;
+
+		pthread_mutex_lock(&ctx.spill_lock);
+		vector_add(ctx.buffers, buffer);
+		pthread_mutex_unlock(&ctx.spill_lock);
+		out->data = buffer;
+	}
+
+	name = ent->dir == WALK_NODIR ? ent->path : ent->name;
+	namelen = ent->dir == WALK_NODIR ? strlen(name) : ent->namelen;
+
+	file = arena_alloc(buffer->arena, sizeof(*file));
+	file->name = arena_strndup(buffer->arena, name, namelen);
+	file->header.cost = file_cost(ent->st);
+	file->header.size = ent->st->st_size;
+	file->header.dev = ent->st->st_dev;
+	file->header.ino = ent->st->st_ino;
+	file->header.dir = ent->dir;
+	file->header.namelen = namelen;
+	vector_add(buffer->items, file);
+
+	++buffer->count;
+	if (buffer->min_cost < 0 || (off_t)file->header.cost <
+	    buffer->min_cost)
+		buffer->min_cost = file->header.cost;
+
+	/* to check the files fit with their directories after the walk */
+	if (ent->dir != WALK_NODIR) {
+		if (ent->dir >= buffer->ndirs) {
+			size_t ndirs = (ent->dir + 1) * 2;
+
+			buffer->dir_max = xrealloc(buffer->dir_max,
+			    ndirs * sizeof(buffer->dir_max[0]));
+			while (buffer->ndirs < ndirs)
+				buffer->dir_max[buffer->ndirs++] = -1;
+		}
+
+		if ((off_t)file->header.cost > buffer->dir_max[ent->dir])
+			buffer->dir_max[ent->dir] = file->header.cost;
+	}
+
+	buffer->bytes += sizeof(*file) + sizeof(file) + namelen + 1;
+	if (buffer->bytes >= ctx.buffer_limit)
+		spill_run(buffer);
 }
 
+struct run_reader {
+	off_t pos;
+	off_t end;
+	char *buf;
+	size_t len;
+	size_t at;
+	size_t size;
+
+	/* the current file, its name is in buf */
+	struct spill_header header;
+	const char *name;
+};
+
 /*
- * Link the contents of a disk to the given destination directory.
+ * Have at least need bytes of the run in the buffer, returns FALSE at
+ * the end of the run.
  */
-static void
-disk_link(struct disk *disk, char *destdir)
+static int
+reader_fill(struct run_reader *reader, size_t need)
 {
-	size_t i, len;
+	if (reader->len - reader->at >= need)
+		return TRUE;
 
-	len = strlen(destdir);
-	for (i = 0; i < disk->files->size; ++i) {
-		struct file *file = disk->files->items[i];
-		char *linkdest;
+	memmove(reader->buf, reader->buf + reader->at,
+	    reader->len - reader->at);
+	reader->len -= reader->at;
+	reader->at = 0;
 
-		linkdest = xcalloc(1, len + strlen(file->name) + 2);
-		sprintf(linkdest, "%s/%s", destdir, file->name);
-		xlink(file->name, linkdest);
-		if (ctx.verbose)
-			printf("%s -> %s\n", file->name, destdir);
-		xfree(linkdest);
+	if (need > reader->size) {
+		reader->size = need * 2;
+		reader->buf = xrealloc(reader->buf, reader->size);
+	}
+
+	while (reader->len < need && reader->pos < reader->end) {
+		size_t want = reader->size - reader->len;
+		ssize_t n;
+
+		if ((off_t)want > reader->end - reader->pos)
+			want = reader->end - reader->pos;
+
+		n = pread(ctx.spill_fd, reader->buf + reader->len, want,
+		    reader->pos);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			die("Can't read temporary file:");
+		}
+		if (n == 0)
+			break;
+
+		reader->len += n;
+		reader->pos += n;
 	}
+
+	if (reader->len == 0)
+		return FALSE;
+	if (reader->len < need)
+		die("Damaged temporary file.");
+
+	return TRUE;
 }
 
+/* read the next file of a run, returns FALSE at the end of it */
 static int
-add_file(struct disk *disk, struct file *file)
+reader_next(struct run_reader *reader)
 {
-	if (disk->free - file->size < 0)
+	if (!reader_fill(reader, sizeof(reader->header)))
 		return FALSE;
 
-	vector_add(disk->files, file);
-	disk->free -= file->size;
+	memcpy(&reader->header, reader->buf + reader->at,
+	    sizeof(reader->header));
+	reader->at += sizeof(reader->header);
+
+	if (!reader_fill(reader, reader->header.namelen))
+		die("Damaged temporary file.");
+
+	reader->name = reader->buf + reader->at;
+	reader->at += reader->header.namelen;
 
 	return TRUE;
 }
 
+/* a heap of run readers, the one with the next file on top */
+struct merge {
+	struct run_reader *readers;
+	size_t *heap;
+	size_t n;
+	size_t nreaders;
+};
+
 static int
-by_size_descending(const void *file_a, const void *file_b)
+merge_less(const struct merge *merge, size_t a, size_t b)
+{
+	int cmp;
+
+	cmp = spill_order(&merge->readers[a].header,
+	    &merge->readers[b].header);
+	STATS_COUNT(STATS_COMPARES, 1);
+
+	return cmp != 0 ? cmp < 0 : a < b;
+}
+
+static void
+merge_down(struct merge *merge, size_t i)
+{
+	for (;;) {
+		size_t least = i, left = 2 * i + 1, right = 2 * i + 2, tmp;
+
+		if (left < merge->n && merge_less(merge, merge->heap[left],
+		    merge->heap[least]))
+			least = left;
+		if (right < merge->n && merge_less(merge, merge->heap[right],
+		    merge->heap[least]))
+			least = right;
+		if (least == i)
+			break;
+
+		tmp = merge->heap[i];
+		merge->heap[i] = merge->heap[least];
+		merge->heap[least] = tmp;
+		i = least;
+	}
+}
+
+static void
+merge_open(struct merge *merge, const struct run *runs, size_t nruns,
+    size_t bufsize)
+{
+	size_t i;
+
+	merge->readers = xcalloc(nruns, sizeof(merge->readers[0]));
+	merge->heap = xcalloc(nruns, sizeof(merge->heap[0]));
+	merge->nreaders = nruns;
+	merge->n = 0;
+
+	for (i = 0; i < nruns; ++i) {
+		struct run_reader *reader = &merge->readers[i];
+
+		reader->pos = runs[i].pos;
+		reader->end = runs[i].pos + runs[i].len;
+		reader->size = bufsize;
+		reader->buf = xcalloc(1, bufsize);
+		if (reader_next(reader))
+			merge->heap[merge->n++] = i;
+	}
+
+	for (i = merge->n / 2; i-- > 0; )
+		merge_down(merge, i);
+}
+
+/* the reader with the next file, or NULL once all runs are done */
+static struct run_reader *
+merge_top(const struct merge *merge)
+{
+	return merge->n > 0 ? &merge->readers[merge->heap[0]] : NULL;
+}
+
+static void
+merge_next(struct merge *merge)
+{
+	if (!reader_next(&merge->readers[merge->heap[0]]))
+		merge->heap[0] = merge->heap[--merge->n];
+	merge_down(merge, 0);
+}
+
+static void
+merge_close(struct merge *merge)
+{
+	size_t i;
+
+	for (i = 0; i < merge->nreaders; ++i)
+		xfree(merge->readers[i].buf);
+	xfree(merge->readers);
+	xfree(merge->heap);
+}
+
+/* the buffer of a reader when merging n runs */
+static size_t
+merge_bufsize(size_t n)
+{
+	size_t size = ctx.memory_limit / 4 / n;
+
+	return size < RUN_BUFSIZE ? RUN_BUFSIZE : size;
+}
+
+/* merge the first n runs into one at the end of the temporary file */
+static void
+merge_runs(size_t n)
+{
+	struct run_writer writer;
+	struct run_reader *reader;
+	struct merge merge;
+	off_t len = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		len += ctx.runs[i].len;
+
+	merge_open(&merge, ctx.runs, n, merge_bufsize(n));
+	memmove(ctx.runs, ctx.runs + n, (ctx.nruns - n) * sizeof(ctx.runs[0]));
+	ctx.nruns -= n;
+
+	writer.pos = add_run(len);
+	writer.buf = xcalloc(1, RUN_BUFSIZE);
+	writer.len = 0;
+	while ((reader = merge_top(&merge)) != NULL) {
+		run_write(&writer, &reader->header, sizeof(reader->header));
+		run_write(&writer, reader->name, reader->header.namelen);
+		merge_next(&merge);
+	}
+	run_flush(&writer);
+	xfree(writer.buf);
+
+	merge_close(&merge);
+}
+
+/* a disk of which the records are written once it is full */
+struct spill_disk {
+	size_t id;
+	off_t free;
+	char *pending;			/* the records as in a run */
+	size_t len;
+	size_t size;
+};
+
+struct spill_fit {
+	struct writer writer;
+	struct freetree *index;
+	struct hashset *dirs;
+	struct vector *disks;
+	off_t min_cost;
+	size_t pending;			/* bytes in all pending records */
+	char *path;
+	size_t pathsize;
+};
+
+static void
+disk_write(struct spill_fit *fit, struct spill_disk *disk)
+{
+	size_t at = 0;
+
+	while (at < disk->len) {
+		struct spill_header header;
+
+		memcpy(&header, disk->pending + at, sizeof(header));
+		at += sizeof(header);
+		write_record(&fit->writer, disk->id, header.size,
+		    join_path(header.dir, disk->pending + at, header.namelen,
+		    &fit->path, &fit->pathsize));
+		at += header.namelen;
+	}
+
+	fit->pending -= disk->len;
+	xfree(disk->pending);
+	disk->len = disk->size = 0;
+}
+
+/* place a file like fit does */
+static void
+spill_place(struct spill_fit *fit, const struct spill_header *header,
+    const char *name)
 {
-	struct file *a = *((struct file **)file_a);
-	struct file *b = *((struct file **)file_b);
+	struct spill_disk *disk;
+	size_t i, j, len;
+	off_t need;
+
+	need = dir_need(header->dir, header->cost);
+	if (ctx.algorithm == BEST_FIT)
+		j = freetree_best_fit(fit->index, need);
+	else
+		j = freetree_first_fit(fit->index, need);
+
+	if (j == FREETREE_NONE) {
+		disk = xcalloc(1, sizeof(*disk));
+		disk->id = fit->disks->size + 1;
+		disk->free = ctx.disk_size;
+		vector_add(fit->disks, disk);
+		j = freetree_add(fit->index, disk->free);
+	}
+
+	disk = fit->disks->items[j];
+	if (!take_room(fit->dirs, disk->id, &disk->free, header->dir,
+	    header->cost))
+		die("add_file failed.");
+	freetree_set(fit->index, j, disk->free);
 
-	return b->size - a->size;
+	if (ctx.do_show_only)
+		return;
+
+	len = sizeof(*header) + header->namelen;
+	if (disk->len + len > disk->size) {
+		disk->size = (disk->len + len) * 2;
+		disk->pending = xrealloc(disk->pending, disk->size);
+	}
+	memcpy(disk->pending + disk->len, header, sizeof(*header));
+	memcpy(disk->pending + disk->len + sizeof(*header), name,
+	    header->namelen);
+	disk->len += len;
+	fit->pending += len;
+
+	if (disk->free < fit->min_cost)
+		disk_write(fit, disk);
+	else if (fit->pending > (size_t)ctx.memory_limit / 4)
+		for (i = 0; i < fit->disks->size; ++i)
+			disk_write(fit, fit->disks->items[i]);
 }
 
 /*
- * Fits files onto disks following a simple algorithm; first sort files
- * by size descending, then loop over the available disks for a fit. If
- * none can hold the file create a new disk containing it.  This will
- * rapidly fill disks while the smaller remaining files will usually
- * make a good final fit.
+ * Fit the files spilled during the walk. The runs are merged down to
+ * a number which can be merged at once, the last merge feeds the fit.
+ * Of the names of a file found more than once the first by path is
+ * kept.
  */
 static void
-fit(struct vector *files, struct vector *disks)
+fit_spilled(void)
 {
-	size_t i;
+	struct spill_header best;
+	struct run_reader *reader;
+	struct spill_fit fit;
+	struct merge merge;
+	char *best_name = NULL, *path = NULL;
+	size_t i, best_size = 0, pathsize = 0, best_pathsize = 0;
+	size_t dropped = 0;
+	uint64_t count = 0;
+	char *best_path = NULL;
+
+	memset(&fit, 0, sizeof(fit));
+	fit.min_cost = -1;
+	for (i = 0; i < ctx.buffers->size; ++i) {
+		struct spill_buffer *buffer = ctx.buffers->items[i];
+
+		spill_run(buffer);
+		count += buffer->count;
+		if (buffer->min_cost >= 0 && (fit.min_cost < 0 ||
+		    buffer->min_cost < fit.min_cost))
+			fit.min_cost = buffer->min_cost;
+	}
 
-	qsort(files->items, files->size, sizeof(files->items[0]),
-	    by_size_descending);
+	if (count == 0)
+		die("no files found.");
 
-	for (i = 0; i < files->size; ++i) {
-		struct file *file = files->items[i];
-		int added = FALSE;
-		size_t j;
+	/* with its directories a file might still not fit */
+	stats_phase("dirs");
+	count_dirs();
+	for (i = 0; i < ctx.buffers->size; ++i) {
+		struct spill_buffer *buffer = ctx.buffers->items[i];
+		size_t dir;
+
+		for (dir = 0; dir < buffer->ndirs; ++dir)
+			if (buffer->dir_max[dir] >= 0 && dir_need(dir,
+			    buffer->dir_max[dir]) > ctx.disk_size)
+				die("Can never fit a file of %s in '%s' with "
+				    "its directories.", number_to_string(
+				    buffer->dir_max[dir]), ctx.dirs->items[dir]);
+
+		vector_free(buffer->items);
+		arena_free(buffer->arena);
+		xfree(buffer->dir_max);
+		xfree(buffer);
+	}
+	vector_free(ctx.buffers);
+	ctx.buffers = NULL;
+
+	stats_phase("merge");
+	while (ctx.nruns > MERGE_FANIN)
+		merge_runs(MERGE_FANIN);
+
+	stats_phase("fit");
+	fit.index = freetree_new();
+	fit.dirs = hashset_new();
+	fit.disks = vector_new();
+	if (!ctx.do_show_only)
+		writer_open(&fit.writer);
+
+	merge_open(&merge, ctx.runs, ctx.nruns, merge_bufsize(ctx.nruns));
+	for (;;) {
+		reader = merge_top(&merge);
+
+		/* a file is placed once the names it has are known */
+		if (best_name != NULL && (reader == NULL ||
+		    spill_order(&best, &reader->header) != 0)) {
+			spill_place(&fit, &best, best_name);
+			xfree(best_name);
+			best_size = 0;
+		}
 
-		for (j = 0; j < disks->size; ++j) {
-			struct disk *disk = disks->items[j];
+		if (reader == NULL)
+			break;
 
-			if (add_file(disk, file)) {
-				added = TRUE;
-				break;
+		if (best_name != NULL) {
+			++dropped;
+			join_path(reader->header.dir, reader->name,
+			    reader->header.namelen, &path, &pathsize);
+			if (path_cmp(path, best_path) >= 0) {
+				merge_next(&merge);
+				continue;
 			}
 		}
 
-		if (!added) {
-			struct disk *disk;
+		best = reader->header;
+		if (best.namelen + 1 > best_size) {
+			best_size = best.namelen + 1;
+			best_name = xrealloc(best_name, best_size);
+		}
+		memcpy(best_name, reader->name, best.namelen);
+		best_name[best.namelen] = '\0';
+		join_path(best.dir, best_name, best.namelen, &best_path,
+		    &best_pathsize);
+		merge_next(&merge);
+	}
+	merge_close(&merge);
 
-			disk = disk_new(ctx.disk_size);
-			if (!add_file(disk, file))
-				die("add_file failed.");
+	/* stdout has the manifest */
+	if (ctx.verbose && dropped > 0)
+		fprintf(stderr, "Skipping %lu files found before.\n",
+		    (ulong) dropped);
 
-			vector_add(disks, disk);
-		}
+	for (i = 0; i < fit.disks->size; ++i) {
+		if (!ctx.do_show_only)
+			disk_write(&fit, fit.disks->items[i]);
+		xfree(fit.disks->items[i]);
 	}
+
+	if (ctx.do_show_only)
+		printf("%lu %s.\n", (ulong) fit.disks->size,
+		    fit.disks->size == 1 ? "disk" : "disks");
+	else
+		writer_close(&fit.writer);
+
+	stats_add(STATS_PROBES, fit.index->probes);
+	freetree_free(fit.index);
+	hashset_free(fit.dirs);
+	vector_free(fit.disks);
+	xfree(fit.path);
+	xfree(path);
+	xfree(best_path);
+	xfree(ctx.runs);
+	close(ctx.spill_fd);
 }
 
-static int
-collect_files(const char *fpath, const struct stat *st, int type,
-    struct FTW *ftwbuf)
+/*
+ * Parse a comma separated list of disk sizes, the largest of them is
+ * used to check if files fit at all.
+ */
+static void
+parse_sizes(char *list)
 {
-	struct file *file;
+	char *size;
+
+	xfree(ctx.disk_sizes);
+	ctx.ndisk_sizes = 0;
+	ctx.disk_size = 0;
 
-	/* skip subdirectories if not doing a recursive collect_files */
-	if (!ctx.do_recursive_search && ftwbuf->level > 1)
-		return 0;
+	for (size = strtok(list, ","); size != NULL; size = strtok(NULL, ",")) {
+		off_t disk_size = string_to_number(size);
+
+		if (disk_size <= 0)
+			die("Invalid disk size '%s'.", size);
+
+		ctx.disk_sizes = xrealloc(ctx.disk_sizes,
+		    (ctx.ndisk_sizes + 1) * sizeof(ctx.disk_sizes[0]));
+		ctx.disk_sizes[ctx.ndisk_sizes++] = disk_size;
+		if (disk_size > ctx.disk_size)
+			ctx.disk_size = disk_size;
+	}
+}
 
+static void
+collect_files(struct walk_out *out, const struct walk_entry *ent)
+{
 	/* there might be access errors */
-	if (type == FTW_NS || type == FTW_SLN || type == FTW_DNR)
-		die("Can't access '%s':", fpath);
+	if (ent->type == WALK_NS || ent->type == WALK_DNR)
+		die("Can't access '%s':", ent->path);
 
 	/* skip directories */
-	if (type == FTW_D)
-		return 0;
+	if (ent->type == WALK_D)
+		return;
+
+	if (!filter_match(&ctx.filter, ent))
+		return;
 
 	/* we can only handle regular files */
-	if (type != FTW_F)
-		die("'%s' is not a regular file.", fpath);
+	if (ent->type != WALK_F)
+		die("'%s' is not a regular file.", ent->path);
 
 	/* which are not too big to fit */
-	if (st->st_size > ctx.disk_size)
-		die("Can never fit '%s' (%s).", fpath,
-		    number_to_string(st->st_size));
-
-	file = file_new(fpath, st->st_size);
-	vector_add(ctx.files, file);
-
-	return 0;
+	if (file_cost(ent->st) > ctx.disk_size)
+		die("Can never fit '%s' (%s).", ent->path,
+		    number_to_string(ent->st->st_size));
+
+	if (ctx.memory_limit > 0)
+		spill_file(out, ent);
+	else
+		vector_add(out->items, found_new(out->arena, ent));
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "%s", usage_string);
+	size_t i;
+
+	for (i = 0; i < sizeof(usage_string) / sizeof(usage_string[0]); ++i)
+		fprintf(stderr, "%s", usage_string[i]);
 	exit(EXIT_FAILURE);
 }
 
 int
 main(int argc, char **argv)
 {
-	char *basedir = NULL;
-	struct vector *disks = NULL;
-	size_t i;
+	char *basedir = NULL, *end;
+	struct vector *disks = NULL, *found, *records = NULL;
+	struct walk walker;
+	size_t i, dropped;
 	int option;
 
-	while ((option = getopt(argc, argv, "l:nrs:v")) != -1) {
+	ctx.block_size = 1;
+	filter_init(&ctx.filter);
+
+	while ((option = getopt(argc, argv, "a:b:d:e:f:i:l:L:m:M:nN:o:p:rs:TuvZ:")) != -1) {
 		switch (option) {
+		case 'a':
+			if (strcmp(optarg, "first") == 0)
+				ctx.algorithm = FIRST_FIT;
+			else if (strcmp(optarg, "best") == 0)
+				ctx.algorithm = BEST_FIT;
+			else
+				usage();
+			break;
+		case 'b':
+			ctx.block_size = string_to_number(optarg);
+			if (ctx.block_size < 0)
+				usage();
+			break;
+		case 'd':
+			ctx.dir_overhead = string_to_number(optarg);
+			if (ctx.dir_overhead < 0)
+				usage();
+			break;
+		case 'e':
+			ctx.extend_path = optarg;
+			break;
+		case 'f':
+			ctx.file_overhead = string_to_number(optarg);
+			if (ctx.file_overhead < 0)
+				usage();
+			break;
+		case 'i':
+			ctx.index_path = optarg;
+			break;
 		case 'l':
 			basedir = clean_path(optarg);
 			ctx.do_link_files = 1;
 			break;
+		case 'L':
+			ctx.memory_limit = string_to_number(optarg);
+			if (ctx.memory_limit <= 0)
+				usage();
+			break;
+		case 'm':
+			if (strcmp(optarg, "link") == 0)
+				ctx.method = LINK;
+			else if (strcmp(optarg, "copy") == 0)
+				ctx.method = COPY;
+			else if (strcmp(optarg, "tar") == 0)
+				ctx.method = TAR;
+			else
+				usage();
+			break;
+		case 'M':
+		case 'N':
+		case 'Z':
+			if (!filter_option(&ctx.filter, option, optarg))
+				usage();
+			break;
 		case 'n':
 			ctx.do_show_only = 1;
 			break;
+		case 'o':
+			ctx.optimize = strtod(optarg, &end);
+			if (*end != '\0' || ctx.optimize <= 0)
+				usage();
+			break;
+		case 'p':
+			if (strcmp(optarg, "human") == 0)
+				ctx.format = HUMAN;
+			else if (strcmp(optarg, "nul") == 0)
+				ctx.format = NUL;
+			else if (strcmp(optarg, "json") == 0)
+				ctx.format = JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				ctx.format = CSV;
+			else
+				usage();
+			break;
 		case 'r':
 			ctx.do_recursive_search = 1;
 			break;
 		case 's':
-			ctx.disk_size = string_to_number(optarg);
+			parse_sizes(optarg);
+			break;
+		case 'T':
+			stats_start();
+			break;
+		case 'u':
+			ctx.dedup = 1;
 			break;
 		case 'v':
 			ctx.verbose = 1;
@@ -312,19 +2743,129 @@ main(int argc, char **argv)
 	if (optind >= argc || ctx.disk_size <= 0)
 		usage();
 
-	ctx.files = vector_new();
-	for (i = optind; (int)i < argc; ++i)
-		if (nftw(argv[i], collect_files, MAXFD, 0) == -1)
-			die("nftw:");
+	/* Multiple sizes only make a table. */
+	if (ctx.ndisk_sizes > 1 && (ctx.do_link_files || ctx.optimize > 0))
+		usage();
+
+	/* The disks of a manifest have one size and stay as they are. */
+	if (ctx.extend_path != NULL && (ctx.ndisk_sizes > 1 ||
+	    ctx.optimize > 0))
+		usage();
+
+	/* Within a memory limit disks are only written to a manifest. */
+	if (ctx.memory_limit > 0 && (ctx.ndisk_sizes > 1 ||
+	    ctx.do_link_files || ctx.optimize > 0 || ctx.dedup ||
+	    ctx.extend_path != NULL ||
+	    (ctx.format == HUMAN && !ctx.do_show_only)))
+		usage();
+
+	/* skip subdirectories if not doing a recursive search */
+	walker.fn = collect_files;
+	walker.flags = WALK_STAT;
+	walker.maxlevel = ctx.do_recursive_search ? -1 : 1;
+	walker.nthreads = 0;
+	walker.dirs = ctx.dirs = vector_new();
+	walker.index = NULL;
+	walker.records = NULL;
+
+	found = vector_new();
+	ctx.arena = arena_new();
+	if (ctx.extend_path != NULL) {
+		stats_phase("manifest");
+		records = manifest_read(ctx.extend_path, ctx.arena);
+	}
+
+	if (ctx.memory_limit > 0)
+		spill_open();
+
+	stats_phase("walk");
+	walk_indexed(&walker, argv + optind, argc - optind, found,
+	    ctx.arena, ctx.index_path);
+
+	if (ctx.memory_limit > 0) {
+		fit_spilled();
+		vector_free(found);
+		xfree(ctx.parents);
+		xfree(ctx.dir_costs);
+		xfree(ctx.chain_costs);
+		vector_free(ctx.dirs);
+		arena_free(ctx.arena);
+		filter_free(&ctx.filter);
+		exit(EXIT_SUCCESS);
+	}
 
-	if (ctx.files->size == 0)
+	if (found->size == 0)
 		die("no files found.");
 
-	disks = vector_new();
-	fit(ctx.files, disks);
+	stats_phase("dedup");
+	dropped = drop_hard_links(found);
+	if (ctx.dedup)
+		dropped += drop_duplicates(found);
+	if (ctx.verbose && dropped > 0)
+		fprintf(message_stream(), "Skipping %lu files found before.\n",
+		    (ulong) dropped);
+
+	if (records != NULL) {
+		dropped = drop_placed(found, records);
+		if (ctx.verbose && dropped > 0)
+			fprintf(message_stream(),
+			    "Skipping %lu files on the disks of '%s'.\n",
+			    (ulong) dropped, ctx.extend_path);
+
+		if (found->size == 0) {
+			if (ctx.verbose)
+				fprintf(message_stream(), "No new files.\n");
+			exit(EXIT_SUCCESS);
+		}
+	}
+
+	/* from here on the files are kept by value */
+	ctx.files = file_vector_new();
+	file_vector_reserve(ctx.files, found->size);
+	for (i = 0; i < found->size; ++i)
+		*file_vector_push(ctx.files) =
+		    ((struct found *)found->items[i])->file;
+	vector_free(found);
+
+	stats_phase("sort");
+	sort_files(ctx.files);
+
+	ctx.sizes = xcalloc(ctx.files->size, sizeof(ctx.sizes[0]));
+	for (i = 0; i < ctx.files->size; ++i)
+		ctx.sizes[i] = ctx.files->items[i].cost;
+
+	/* with its directories a file might still not fit */
+	stats_phase("dirs");
+	count_dirs();
+	for (i = 0; i < ctx.files->size; ++i) {
+		if (file_need(i) > ctx.disk_size) {
+			char *path = NULL;
+			size_t pathsize = 0;
+
+			die("Can never fit '%s' with its directories.",
+			    file_path(&ctx.files->items[i], &path, &pathsize));
+		}
+
+		if (file_need(i) > ctx.largest)
+			ctx.largest = file_need(i);
+	}
+
+	if (ctx.ndisk_sizes > 1) {
+		stats_phase("plan");
+		plan();
+		exit(EXIT_SUCCESS);
+	}
+
+	disks = records != NULL ? fixed_disks(records) : vector_new();
+	stats_phase("fit");
+	fit(disks, ctx.disk_size);
+	if (ctx.optimize > 0) {
+		stats_phase("optimize");
+		optimize(disks);
+	}
 
 	/* There is room for 4 digits in the format string(s). */
-	if (disks->size > 9999)
+	if (((struct disk *)disks->items[disks->size - 1])->id > 9999)
 		die("Fitting takes too many (%lu) disks.", disks->size);
 
 	if (ctx.do_show_only) {
@@ -333,24 +2874,51 @@ main(int argc, char **argv)
 		exit(EXIT_SUCCESS);
 	}
 
-	for (i = 0; i < disks->size; ++i) {
-		struct disk *disk = disks->items[i];
+	/* only the disks which got new files are linked and shown */
+	if (records != NULL) {
+		size_t j;
 
-		if (ctx.do_link_files) {
-			char *dest;
+		for (i = j = 0; i < disks->size; ++i) {
+			struct disk *disk = disks->items[i];
 
-			dest = xcalloc(1, strlen(basedir) + 6);
-			sprintf(dest, "%s/%04lu", basedir, (ulong) disk->id);
-			make_directories(dest);
-			disk_link(disk, dest);
-			xfree(dest);
-		} else
-			disk_print(disk);
+			if (disk->files->size > 0)
+				disks->items[j++] = disk;
+			else
+				disk_free(disk);
+		}
+		disks->size = j;
+	}
+
+	if (ctx.do_link_files) {
+		stats_phase("link");
+		link_disks(disks, basedir);
+	}
+
+	/* a manifest is also written for the disks just linked */
+	stats_phase("output");
+	if (ctx.format != HUMAN)
+		write_manifest(disks);
+	else if (!ctx.do_link_files) {
+		setvbuf(stdout, NULL, _IOFBF, WRITER_BUFSIZE);
+		for (i = 0; i < disks->size; ++i)
+			disk_print(disks->items[i]);
 	}
 
 	vector_foreach(disks, disk_free);
-	vector_free(ctx.files);
+	file_vector_free(ctx.files);
+	xfree(ctx.sizes);
+	xfree(ctx.parents);
+	xfree(ctx.dir_costs);
+	xfree(ctx.chain_costs);
+	vector_free(ctx.dirs);
 	vector_free(disks);
+	if (records != NULL) {
+		vector_free(records);
+		if (ctx.fixed_dirs != NULL)
+			index_vector_free(ctx.fixed_dirs);
+	}
+	arena_free(ctx.arena);
+	filter_free(&ctx.filter);
 
 	if (ctx.do_link_files)
 		xfree(basedir);
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+
+#include "freetree.h"
+#include "utils.h"
+
+#define NIL FREETREE_NONE
+#define NODE(t, n) (&(t)->nodes[(n)])
+
+struct freetree *
+freetree_new(void)
+{
+	struct freetree *t;
+
+	t = xcalloc(1, sizeof(*t));
+	t->nodes = xcalloc(INITIAL_FREETREE_CAPACITY, sizeof(t->nodes[0]));
+	t->capacity = INITIAL_FREETREE_CAPACITY;
+	t->size = 0;
+	t->root = NIL;
+
+	return t;
+}
+
+void
+freetree_free(struct freetree *t)
+{
+	xfree(t->nodes);
+	xfree(t);
+}
+
+/*
+ * Scramble the bin index into a priority, this keeps the treap
+ * balanced without needing a random number generator.
+ */
+static unsigned int
+priority(size_t index)
+{
+	unsigned long h = index + 1;
+
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h &= 0xffffffffUL;
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h &= 0xffffffffUL;
+	h ^= h >> 16;
+
+	return (unsigned int)h;
+}
+
+/* order by free space first and by bin index on ties */
+static int
+less(const struct freetree *t, size_t a, size_t b)
+{
+	const struct freetree_node *na = NODE(t, a), *nb = NODE(t, b);
+
+	if (na->free != nb->free)
+		return na->free < nb->free;
+
+	return a < b;
+}
+
+static size_t
+min_index(const struct freetree *t, size_t n)
+{
+	return n == NIL ? NIL : NODE(t, n)->min_index;
+}
+
+static void
+update(struct freetree *t, size_t n)
+{
+	struct freetree_node *node = NODE(t, n);
+	size_t left = min_index(t, node->left);
+	size_t right = min_index(t, node->right);
+
+	/* NIL is the largest size_t so it never wins */
+	node->min_index = n;
+	if (left < node->min_index)
+		node->min_index = left;
+	if (right < node->min_index)
+		node->min_index = right;
+}
+
+static size_t
+insert(struct freetree *t, size_t root, size_t n)
+{
+	struct freetree_node *node;
+	size_t child;
+
+	if (root == NIL) {
+		update(t, n);
+		return n;
+	}
+
+	node = NODE(t, root);
+	if (less(t, n, root)) {
+		child = insert(t, node->left, n);
+		node->left = child;
+
+		/* rotate right */
+		if (NODE(t, child)->priority > node->priority) {
+			node->left = NODE(t, child)->right;
+			update(t, root);
+			NODE(t, child)->right = root;
+			update(t, child);
+			return child;
+		}
+	} else {
+		child = insert(t, node->right, n);
+		node->right = child;
+
+		/* rotate left */
+		if (NODE(t, child)->priority > node->priority) {
+			node->right = NODE(t, child)->left;
+			update(t, root);
+			NODE(t, child)->left = root;
+			update(t, child);
+			return child;
+		}
+	}
+
+	update(t, root);
+	return root;
+}
+
+/* join two treaps where every key in a is less than every key in b */
+static size_t
+merge(struct freetree *t, size_t a, size_t b)
+{
+	if (a == NIL)
+		return b;
+	if (b == NIL)
+		return a;
+
+	if (NODE(t, a)->priority > NODE(t, b)->priority) {
+		NODE(t, a)->right = merge(t, NODE(t, a)->right, b);
+		update(t, a);
+		return a;
+	}
+
+	NODE(t, b)->left = merge(t, a, NODE(t, b)->left);
+	update(t, b);
+	return b;
+}
+
+static size_t
+remove_node(struct freetree *t, size_t root, size_t n)
+{
+	struct freetree_node *node;
+
+	if (root == NIL)
+		die("freetree: bin %lu not found.", (ulong) n);
+
+	node = NODE(t, root);
+	if (root == n)
+		return merge(t, node->left, node->right);
+
+	if (less(t, n, root))
+		node->left = remove_node(t, node->left, n);
+	else
+		node->right = remove_node(t, node->right, n);
+
+	update(t, root);
+	return root;
+}
+
+/*
+ * Add a new bin with the given free space, bins are numbered in
+ * the order they are added starting at zero.
+ */
+size_t
+freetree_add(struct freetree *t, off_t free)
+{
+	struct freetree_node *node;
+	size_t n;
+
+	if (t->size == t->capacity) {
+		size_t new_capacity = t->capacity + (t->capacity >> 1);
+		size_t new_size = new_capacity * sizeof(t->nodes[0]);
+
+		t->nodes = xrealloc(t->nodes, new_size);
+		t->capacity = new_capacity;
+	}
+
+	n = t->size++;
+	node = NODE(t, n);
+	node->free = free;
+	node->left = NIL;
+	node->right = NIL;
+	node->priority = priority(n);
+	t->root = insert(t, t->root, n);
+
+	return n;
+}
+
+void
+freetree_set(struct freetree *t, size_t n, off_t free)
+{
+	if (n >= t->size)
+		die("freetree: bin %lu out of range.", (ulong) n);
+
+	if (NODE(t, n)->free == free)
+		return;
+
+	t->root = remove_node(t, t->root, n);
+	NODE(t, n)->free = free;
+	NODE(t, n)->left = NIL;
+	NODE(t, n)->right = NIL;
+	t->root = insert(t, t->root, n);
+}
+
+/*
+ * Find the lowest numbered bin which can hold size, this is the bin
+ * a linear first fit scan would have found.
+ */
+size_t
+freetree_first_fit(struct freetree *t, off_t size)
+{
+	size_t best = NIL;
+	size_t n = t->root;
+
+	while (n != NIL) {
+		const struct freetree_node *node = NODE(t, n);
+
+		++t->probes;
+		if (node->free >= size) {
+			size_t right = min_index(t, node->right);
+
+			/* this node and everything right of it fits */
+			if (n < best)
+				best = n;
+			if (right < best)
+				best = right;
+
+			n = node->left;
+		} else
+			n = node->right;
+	}
+
+	return best;
+}
+
+/*
+ * Find the bin with the least free space which can still hold size,
+ * ties go to the lowest numbered bin.
+ */
+size_t
+freetree_best_fit(struct freetree *t, off_t size)
+{
+	size_t best = NIL;
+	size_t n = t->root;
+
+	while (n != NIL) {
+		const struct freetree_node *node = NODE(t, n);
+
+		++t->probes;
+		if (node->free >= size) {
+			best = n;
+			n = node->left;
+		} else
+			n = node->right;
+	}
+
+	return best;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FREETREE_H
+#define FREETREE_H
+
+#include <sys/types.h>
+
+/*
+ * A free space index over numbered bins. Bins are kept in a treap
+ * ordered by (free, index) and every node knows the lowest index in
+ * its subtree, so both first and best fit lookups are O(log n).
+ */
+struct freetree_node {
+	off_t free;
+	size_t left;
+	size_t right;
+	size_t min_index;
+	unsigned int priority;
+};
+
+struct freetree {
+	struct freetree_node *nodes;
+	size_t size;
+	size_t capacity;
+	size_t root;
+	size_t probes;			/* nodes looked at by the lookups */
+};
+
+#define INITIAL_FREETREE_CAPACITY 128
+
+/* returned by the lookups when no bin has enough free space */
+#define FREETREE_NONE ((size_t)-1)
+
+struct freetree *freetree_new(void);
+void freetree_free(struct freetree *);
+size_t freetree_add(struct freetree *, off_t);
+void freetree_set(struct freetree *, size_t, off_t);
+size_t freetree_first_fit(struct freetree *, off_t);
+size_t freetree_best_fit(struct freetree *, off_t);
+
+#endif
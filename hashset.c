@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hashset.h"
+#include "utils.h"
+
+static size_t
+hash(uint64_t a, uint64_t b)
+{
+	uint64_t h;
+
+	h = a * UINT64_C(0x9e3779b97f4a7c15) ^ b;
+	h ^= h >> 32;
+	h *= UINT64_C(0xd6e8feb86659fd93);
+	h ^= h >> 32;
+
+	return (size_t)h;
+}
+
+/* the slot of a key or the empty slot where it would go */
+static size_t
+slot(const struct hashset *set, uint64_t a, uint64_t b)
+{
+	size_t i, mask = set->capacity - 1;
+
+	for (i = hash(a, b) & mask; set->used[i]; i = (i + 1) & mask)
+		if (set->keys[i].a == a && set->keys[i].b == b)
+			break;
+
+	return i;
+}
+
+struct hashset *
+hashset_new(void)
+{
+	struct hashset *set;
+
+	set = xcalloc(1, sizeof(*set));
+	set->keys = xcalloc(INITIAL_HASHSET_CAPACITY, sizeof(set->keys[0]));
+	set->values = xcalloc(INITIAL_HASHSET_CAPACITY,
+	    sizeof(set->values[0]));
+	set->used = xcalloc(INITIAL_HASHSET_CAPACITY, 1);
+	set->capacity = INITIAL_HASHSET_CAPACITY;
+
+	return set;
+}
+
+void
+hashset_free(struct hashset *set)
+{
+	xfree(set->keys);
+	xfree(set->values);
+	xfree(set->used);
+	xfree(set);
+}
+
+static void
+grow(struct hashset *set)
+{
+	struct hashset_key *keys = set->keys;
+	size_t *values = set->values;
+	char *used = set->used;
+	size_t i, capacity = set->capacity;
+
+	set->capacity *= 2;
+	set->keys = xcalloc(set->capacity, sizeof(set->keys[0]));
+	set->values = xcalloc(set->capacity, sizeof(set->values[0]));
+	set->used = xcalloc(set->capacity, 1);
+	for (i = 0; i < capacity; ++i) {
+		if (used[i]) {
+			size_t j = slot(set, keys[i].a, keys[i].b);
+
+			set->keys[j] = keys[i];
+			set->values[j] = values[i];
+			set->used[j] = 1;
+		}
+	}
+
+	xfree(keys);
+	xfree(values);
+	xfree(used);
+}
+
+/*
+ * Add a key to the set, returns FALSE if it was in there already.
+ */
+int
+hashset_add(struct hashset *set, uint64_t a, uint64_t b)
+{
+	size_t i;
+
+	if ((set->size + 1) * 2 > set->capacity)
+		grow(set);
+
+	i = slot(set, a, b);
+	if (set->used[i])
+		return FALSE;
+
+	set->keys[i].a = a;
+	set->keys[i].b = b;
+	set->values[i] = HASHSET_NONE;
+	set->used[i] = 1;
+	++set->size;
+
+	return TRUE;
+}
+
+int
+hashset_contains(const struct hashset *set, uint64_t a, uint64_t b)
+{
+	return set->used[slot(set, a, b)];
+}
+
+/*
+ * The value kept with a key, adding the key if needed. It stays valid
+ * until the next key is added.
+ */
+size_t *
+hashset_value(struct hashset *set, uint64_t a, uint64_t b)
+{
+	hashset_add(set, a, b);
+
+	return &set->values[slot(set, a, b)];
+}
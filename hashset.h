@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HASHSET_H
+#define HASHSET_H
+
+#include <stdint.h>
+
+/*
+ * A set of pairs of numbers, like a device and inode, kept in an open
+ * addressing table which is grown when it gets half full. Every key
+ * can have a value kept with it.
+ */
+struct hashset_key {
+	uint64_t a;
+	uint64_t b;
+};
+
+struct hashset {
+	struct hashset_key *keys;
+	size_t *values;
+	char *used;
+	size_t size;
+	size_t capacity;
+};
+
+#define INITIAL_HASHSET_CAPACITY 256
+
+/* the value of a key which didn't have one yet */
+#define HASHSET_NONE ((size_t)-1)
+
+struct hashset *hashset_new(void);
+void hashset_free(struct hashset *);
+int hashset_add(struct hashset *, uint64_t, uint64_t);
+int hashset_contains(const struct hashset *, uint64_t, uint64_t);
+size_t *hashset_value(struct hashset *, uint64_t, uint64_t);
+
+#endif
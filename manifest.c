@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 600
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "manifest.h"
+#include "vector.h"
+#include "utils.h"
+
+/* the line a CSV manifest starts with */
+#define CSV_HEADER "disk,size,path"
+
+struct parser {
+	const char *path;
+	const char *p;
+	const char *end;
+	ulong record;			/* counted from 1 for errors */
+
+	/* a string being decoded */
+	char *buf;
+	size_t len;
+	size_t bufsize;
+};
+
+static void
+bad_record(const struct parser *parser)
+{
+	die("Bad record %lu in '%s'.", parser->record, parser->path);
+}
+
+static void
+expect(struct parser *parser, char c)
+{
+	if (parser->p == parser->end || *parser->p != c)
+		bad_record(parser);
+
+	++parser->p;
+}
+
+static uint64_t
+parse_number(struct parser *parser)
+{
+	uint64_t n = 0;
+	const char *start = parser->p;
+
+	for (; parser->p < parser->end && *parser->p >= '0' &&
+	    *parser->p <= '9'; ++parser->p) {
+		if (n > (UINT64_MAX - 9) / 10)
+			bad_record(parser);
+		n = n * 10 + (*parser->p - '0');
+	}
+
+	if (parser->p == start)
+		bad_record(parser);
+
+	return n;
+}
+
+static void
+put(struct parser *parser, char c)
+{
+	if (parser->len == parser->bufsize) {
+		parser->bufsize = parser->bufsize == 0 ? 256 :
+		    parser->bufsize * 2;
+		parser->buf = xrealloc(parser->buf, parser->bufsize);
+	}
+
+	parser->buf[parser->len++] = c;
+}
+
+static unsigned long
+parse_hex4(struct parser *parser)
+{
+	unsigned long n = 0;
+	int i;
+
+	if (parser->end - parser->p < 4)
+		bad_record(parser);
+
+	for (i = 0; i < 4; ++i) {
+		char c = *parser->p++;
+
+		n <<= 4;
+		if (c >= '0' && c <= '9')
+			n |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			n |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			n |= c - 'A' + 10;
+		else
+			bad_record(parser);
+	}
+
+	return n;
+}
+
+/* put a code point from a \u escape as UTF-8 */
+static void
+put_utf8(struct parser *parser, unsigned long c)
+{
+	if (c < 0x80)
+		put(parser, (char)c);
+	else if (c < 0x800) {
+		put(parser, (char)(0xc0 | c >> 6));
+		put(parser, (char)(0x80 | (c & 0x3f)));
+	} else if (c < 0x10000) {
+		put(parser, (char)(0xe0 | c >> 12));
+		put(parser, (char)(0x80 | (c >> 6 & 0x3f)));
+		put(parser, (char)(0x80 | (c & 0x3f)));
+	} else {
+		put(parser, (char)(0xf0 | c >> 18));
+		put(parser, (char)(0x80 | (c >> 12 & 0x3f)));
+		put(parser, (char)(0x80 | (c >> 6 & 0x3f)));
+		put(parser, (char)(0x80 | (c & 0x3f)));
+	}
+}
+
+/* decode a JSON string to parser->buf, without a terminating NUL */
+static void
+parse_json_string(struct parser *parser)
+{
+	parser->len = 0;
+	expect(parser, '"');
+
+	for (;;) {
+		unsigned long c;
+
+		if (parser->p == parser->end)
+			bad_record(parser);
+
+		c = (uchar)*parser->p++;
+		if (c == '"')
+			break;
+		if (c != '\\') {
+			put(parser, (char)c);
+			continue;
+		}
+
+		if (parser->p == parser->end)
+			bad_record(parser);
+
+		switch (*parser->p++) {
+		case '"':
+		case '\\':
+		case '/':
+			put(parser, parser->p[-1]);
+			break;
+		case 'b':
+			put(parser, '\b');
+			break;
+		case 'f':
+			put(parser, '\f');
+			break;
+		case 'n':
+			put(parser, '\n');
+			break;
+		case 'r':
+			put(parser, '\r');
+			break;
+		case 't':
+			put(parser, '\t');
+			break;
+		case 'u':
+			c = parse_hex4(parser);
+
+			/* a surrogate pair makes up one code point */
+			if (c >= 0xd800 && c < 0xdc00 &&
+			    parser->end - parser->p >= 6 &&
+			    parser->p[0] == '\\' && parser->p[1] == 'u') {
+				unsigned long low;
+
+				parser->p += 2;
+				low = parse_hex4(parser);
+				if (low < 0xdc00 || low >= 0xe000)
+					bad_record(parser);
+				c = 0x10000 + ((c - 0xd800) << 10) +
+				    (low - 0xdc00);
+			}
+
+			if (c == 0)
+				bad_record(parser);
+			put_utf8(parser, c);
+			break;
+		default:
+			bad_record(parser);
+		}
+	}
+}
+
+static void
+skip_space(struct parser *parser)
+{
+	while (parser->p < parser->end && (*parser->p == ' ' ||
+	    *parser->p == '\t' || *parser->p == '\r' || *parser->p == '\n'))
+		++parser->p;
+}
+
+/* a record is an object with the members disk, size and path */
+static void
+parse_json(struct parser *parser, struct manifest_record *record,
+    struct arena *arena)
+{
+	int seen = 0;
+
+	expect(parser, '{');
+	for (;;) {
+		skip_space(parser);
+		parse_json_string(parser);
+		skip_space(parser);
+		expect(parser, ':');
+		skip_space(parser);
+
+		if (parser->len == 4 && memcmp(parser->buf, "disk", 4) == 0) {
+			record->disk = parse_number(parser);
+			seen |= 1;
+		} else if (parser->len == 4 &&
+		    memcmp(parser->buf, "size", 4) == 0) {
+			record->size = parse_number(parser);
+			seen |= 2;
+		} else if (parser->len == 4 &&
+		    memcmp(parser->buf, "path", 4) == 0) {
+			parse_json_string(parser);
+			record->path = arena_strndup(arena, parser->buf,
+			    parser->len);
+			seen |= 4;
+		} else
+			bad_record(parser);
+
+		skip_space(parser);
+		if (parser->p < parser->end && *parser->p == ',') {
+			++parser->p;
+			continue;
+		}
+		expect(parser, '}');
+		break;
+	}
+
+	if (seen != 7)
+		bad_record(parser);
+}
+
+/* the path is the last field, quoted if it has to be */
+static void
+parse_csv(struct parser *parser, struct manifest_record *record,
+    struct arena *arena)
+{
+	record->disk = parse_number(parser);
+	expect(parser, ',');
+	record->size = parse_number(parser);
+	expect(parser, ',');
+
+	parser->len = 0;
+	if (parser->p < parser->end && *parser->p == '"') {
+		++parser->p;
+		for (;;) {
+			if (parser->p == parser->end)
+				bad_record(parser);
+
+			if (*parser->p == '"') {
+				if (parser->end - parser->p < 2 ||
+				    parser->p[1] != '"') {
+					++parser->p;
+					break;
+				}
+				++parser->p;
+			}
+			put(parser, *parser->p++);
+		}
+	} else
+		for (; parser->p < parser->end && *parser->p != '\n' &&
+		    *parser->p != '\r'; ++parser->p)
+			put(parser, *parser->p);
+
+	if (parser->p < parser->end && *parser->p == '\r')
+		++parser->p;
+	if (parser->p < parser->end)
+		expect(parser, '\n');
+
+	record->path = arena_strndup(arena, parser->buf, parser->len);
+}
+
+static void
+parse_nul(struct parser *parser, struct manifest_record *record,
+    struct arena *arena)
+{
+	const char *nul;
+
+	record->disk = parse_number(parser);
+	expect(parser, '\t');
+	record->size = parse_number(parser);
+	expect(parser, '\t');
+
+	nul = memchr(parser->p, '\0', parser->end - parser->p);
+	if (nul == NULL)
+		bad_record(parser);
+
+	record->path = arena_strndup(arena, parser->p, nul - parser->p);
+	parser->p = nul + 1;
+}
+
+/*
+ * Read the manifest at path, which can be in any of the formats fit
+ * writes. Returns a vector of records allocated from arena.
+ */
+struct vector *
+manifest_read(const char *path, struct arena *arena)
+{
+	enum { NUL, JSON, CSV } format;
+	struct parser parser;
+	struct vector *records;
+	struct stat st;
+	void *map;
+	int fd;
+
+	records = vector_new();
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1)
+		die("Can't open '%s':", path);
+
+	if (st.st_size == 0) {
+		close(fd);
+		return records;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		die("Can't map '%s':", path);
+	close(fd);
+
+	memset(&parser, 0, sizeof(parser));
+	parser.path = path;
+	parser.p = map;
+	parser.end = parser.p + st.st_size;
+
+	if (*parser.p == '{')
+		format = JSON;
+	else if ((size_t)st.st_size > sizeof(CSV_HEADER) - 1 &&
+	    memcmp(parser.p, CSV_HEADER, sizeof(CSV_HEADER) - 1) == 0) {
+		format = CSV;
+		parser.p += sizeof(CSV_HEADER) - 1;
+		if (*parser.p == '\r')
+			++parser.p;
+		expect(&parser, '\n');
+	} else
+		format = NUL;
+
+	while (parser.p < parser.end) {
+		struct manifest_record *record;
+
+		if (format == JSON) {
+			skip_space(&parser);
+			if (parser.p == parser.end)
+				break;
+		}
+
+		++parser.record;
+		record = arena_alloc(arena, sizeof(*record));
+		switch (format) {
+		case NUL:
+			parse_nul(&parser, record, arena);
+			break;
+		case JSON:
+			parse_json(&parser, record, arena);
+			break;
+		case CSV:
+			parse_csv(&parser, record, arena);
+			break;
+		}
+
+		if (record->disk == 0 || record->size < 0 ||
+		    record->path[0] == '\0')
+			bad_record(&parser);
+		vector_add(records, record);
+	}
+
+	munmap(map, st.st_size);
+	xfree(parser.buf);
+
+	return records;
+}
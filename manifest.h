@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <sys/types.h>
+
+/*
+ * A manifest as fit writes it, a record per file with the disk it is
+ * on, its size in bytes and its path. The records are NUL terminated
+ * with tab separated fields, JSON objects a line or CSV lines after a
+ * line naming the fields.
+ */
+struct arena;
+struct vector;
+
+struct manifest_record {
+	size_t disk;
+	off_t size;
+	const char *path;
+};
+
+struct vector *manifest_read(const char *, struct arena *);
+
+#endif
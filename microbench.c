@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks of the building blocks of the tools. Every result
+ * is printed as a tab separated line of the benchmark, the number of
+ * items, the seconds it took and the items per second.
+ */
+
+#define _XOPEN_SOURCE 600
+#include <sys/types.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binpack.h"
+#include "freetree.h"
+#include "rng.h"
+#include "vector.h"
+#include "utils.h"
+
+#define DISK_SIZE (4700L * 1000 * 1000)
+
+static struct rng rng;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *name, size_t n, double start)
+{
+	double seconds = now() - start;
+
+	printf("micro\t%s\t%lu\t%.6f\t%.0f\n", name, (ulong) n, seconds,
+	    seconds > 0 ? n / seconds : 0);
+}
+
+static off_t *
+random_sizes(size_t n)
+{
+	off_t *sizes;
+	size_t i;
+
+	sizes = xcalloc(n, sizeof(sizes[0]));
+	for (i = 0; i < n; ++i)
+		sizes[i] = 1 + rng_below(&rng, 10 * 1000 * 1000);
+
+	return sizes;
+}
+
+static int
+by_size_desc(const void *a, const void *b)
+{
+	off_t x = *(const off_t *)a, y = *(const off_t *)b;
+
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* what fit() does, look up a disk for every file and update it */
+static void
+bench_fit(const char *name, size_t n, int best)
+{
+	struct freetree *tree;
+	off_t *sizes, *frees = NULL;
+	size_t i, ndisks = 0;
+	double start;
+
+	sizes = random_sizes(n);
+	qsort(sizes, n, sizeof(sizes[0]), by_size_desc);
+
+	start = now();
+	tree = freetree_new();
+	for (i = 0; i < n; ++i) {
+		size_t disk;
+
+		disk = best ? freetree_best_fit(tree, sizes[i]) :
+		    freetree_first_fit(tree, sizes[i]);
+		if (disk == FREETREE_NONE) {
+			frees = xrealloc(frees, (ndisks + 1) * sizeof(frees[0]));
+			frees[ndisks] = DISK_SIZE;
+			disk = freetree_add(tree, DISK_SIZE);
+			++ndisks;
+		}
+		frees[disk] -= sizes[i];
+		freetree_set(tree, disk, frees[disk]);
+	}
+	freetree_free(tree);
+	report(name, n, start);
+
+	if (!best) {
+		start = now();
+		binpack_lower_bound(sizes, n, DISK_SIZE);
+		report("lower_bound", n, start);
+	}
+
+	xfree(frees);
+	xfree(sizes);
+}
+
+static void
+bench_vector(size_t n)
+{
+	struct vector *v;
+	size_t i;
+	double start;
+
+	start = now();
+	v = vector_new();
+	for (i = 0; i < n; ++i)
+		vector_add(v, (void *)(i + 1));
+	report("vector_add", n, start);
+
+	start = now();
+	vector_shuffle(v);
+	report("vector_shuffle", n, start);
+
+	vector_free(v);
+}
+
+static void
+bench_numbers(size_t n)
+{
+	char buf[NUMBER_BUFSIZE], *str;
+	size_t i;
+	off_t sum = 0;
+	double start;
+
+	start = now();
+	for (i = 0; i < n; ++i) {
+		str = number_to_string((double)(i * 7919));
+		xfree(str);
+	}
+	report("number_to_string", n, start);
+
+	start = now();
+	for (i = 0; i < n; ++i)
+		format_number(buf, (double)(i * 7919));
+	report("format_number", n, start);
+
+	start = now();
+	for (i = 0; i < n; ++i) {
+		sprintf(buf, "%lu%c", (ulong)(i % 1000), "bkmgt"[i % 5]);
+		sum += string_to_number(buf);
+	}
+	report("string_to_number", n, start);
+
+	/* keep the loop from being optimized out */
+	if (sum == -1)
+		putchar('\n');
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t n = 1000000;
+
+	if (argc > 2 || (argc == 2 && (n = strtoul(argv[1], NULL, 10)) == 0)) {
+		fputs("usage: microbench [count]\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	rng_seed(&rng, 1);
+	vector_seed(1);
+
+	bench_fit("fit_first", n, FALSE);
+	bench_fit("fit_best", n, TRUE);
+	bench_vector(n * 10);
+	bench_numbers(n);
+
+	return EXIT_SUCCESS;
+}
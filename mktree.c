@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* split in parts, C89 doesn't guarantee longer string literals */
+static const char *const usage_string[] = { "\
+usage:  mktree -n count [-d depth] [-w width] [-s min,max] [-l] [-S seed]\n\
+        directory\n\
+\n\
+options:\n\
+  -n count       Make this many files.\n\
+  -d depth       Spread them over directories this deep, 3 by default.\n\
+  -w width       Put about this many files in a directory, 100 by\n\
+                 default.\n\
+", "\
+  -s min,max     Give files a size from min to max, 0,1m by default.\n\
+  -l             Pick sizes uniformly on a log scale so there are\n\
+                 many small files and few large ones.\n\
+  -S seed        Make the same tree for the same seed.\n\
+  directory      Where to make the tree.\n\
+\n\
+  Files are sparse so they take up next to no space, they get an\n\
+  extension and a modification time from the last ten years.\n\
+\n" };
+
+#define _XOPEN_SOURCE 700
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rng.h"
+#include "utils.h"
+
+static const char *const extensions[] = {
+	"mp3", "flac", "ogg", "sid", "mus", "prg", "txt", "jpg"
+};
+
+static struct context {
+	ulong count;
+	int depth;
+	ulong width;
+	off_t min_size;
+	off_t max_size;
+	int log_sizes;
+	struct rng rng;
+} ctx;
+
+static off_t
+random_size(void)
+{
+	double lo, hi, r;
+
+	if (ctx.max_size <= ctx.min_size)
+		return ctx.min_size;
+
+	if (!ctx.log_sizes)
+		return ctx.min_size + (off_t)rng_below(&ctx.rng,
+		    ctx.max_size - ctx.min_size + 1);
+
+	lo = log(ctx.min_size + 1.0);
+	hi = log(ctx.max_size + 1.0);
+	r = (double)(rng_next(&ctx.rng) >> 11) / 9007199254740992.0;
+
+	return (off_t)(exp(lo + r * (hi - lo)) - 1);
+}
+
+/*
+ * Make the tree. The directories are numbered and directory i is
+ * found by writing i in base fanout with a digit per level, so the
+ * leaves are filled in order without keeping any of them around.
+ */
+static void
+make_tree(char *root)
+{
+	struct timespec times[2];
+	ulong ndirs, fanout, dir, file;
+	char *path;
+	size_t pathsize;
+	time_t now = time(NULL);
+	int level;
+
+	ndirs = (ctx.count + ctx.width - 1) / ctx.width;
+	if (ndirs == 0)
+		ndirs = 1;
+	/* the smallest fanout that has room for them at this depth */
+	for (fanout = 1;; ++fanout) {
+		double leaves = 1;
+
+		for (level = 0; level < ctx.depth && leaves < ndirs; ++level)
+			leaves *= fanout;
+		if (leaves >= ndirs)
+			break;
+	}
+
+	pathsize = strlen(root) + ctx.depth * 8 + 32;
+	path = xcalloc(1, pathsize);
+
+	make_directories(root);
+	for (file = 0, dir = 0; file < ctx.count; ++dir) {
+		ulong n, i, rest = dir;
+		size_t len;
+
+		len = sprintf(path, "%s", root);
+		for (level = 0; level < ctx.depth; ++level) {
+			ulong digit = rest % fanout;
+
+			rest /= fanout;
+			len += sprintf(path + len, "/d%lu", digit);
+			if (mkdir(path, 0700) == -1 && errno != EEXIST)
+				die("Can't make directory '%s':", path);
+		}
+
+		n = ctx.width;
+		if (n > ctx.count - file)
+			n = ctx.count - file;
+
+		for (i = 0; i < n; ++i, ++file) {
+			int fd;
+
+			sprintf(path + len, "/f%lu.%s", file,
+			    extensions[rng_below(&ctx.rng,
+			    sizeof(extensions) / sizeof(extensions[0]))]);
+
+			fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+			if (fd == -1)
+				die("Can't create '%s':", path);
+			if (ftruncate(fd, random_size()) == -1)
+				die("Can't size '%s':", path);
+
+			times[0].tv_sec = times[1].tv_sec = now -
+			    (time_t)rng_below(&ctx.rng, 10 * 365 * 86400L);
+			times[0].tv_nsec = times[1].tv_nsec = 0;
+			if (futimens(fd, times) == -1)
+				die("Can't set the time of '%s':", path);
+			close(fd);
+		}
+	}
+
+	xfree(path);
+}
+
+static void
+usage(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(usage_string) / sizeof(usage_string[0]); ++i)
+		fprintf(stderr, "%s", usage_string[i]);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *comma, *end, *root;
+	uint64_t seed = 0;
+	int opt;
+
+	ctx.depth = 3;
+	ctx.width = 100;
+	ctx.max_size = 1000 * 1000;
+
+	while ((opt = getopt(argc, argv, "d:ln:s:S:w:")) != -1) {
+		switch (opt) {
+		case 'd':
+			ctx.depth = atoi(optarg);
+			if (ctx.depth < 1 || ctx.depth > 64)
+				usage();
+			break;
+		case 'l':
+			ctx.log_sizes = TRUE;
+			break;
+		case 'n':
+			ctx.count = strtoul(optarg, &end, 10);
+			if (*optarg == '\0' || *end != '\0')
+				usage();
+			break;
+		case 's':
+			comma = strchr(optarg, ',');
+			if (comma == NULL)
+				usage();
+			*comma = '\0';
+			ctx.min_size = string_to_number(optarg);
+			ctx.max_size = string_to_number(comma + 1);
+			if (ctx.min_size < 0 || ctx.max_size < ctx.min_size)
+				usage();
+			break;
+		case 'S':
+			seed = strtoul(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0')
+				usage();
+			break;
+		case 'w':
+			ctx.width = strtoul(optarg, &end, 10);
+			if (ctx.width == 0 || *end != '\0')
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1 || ctx.count == 0)
+		usage();
+
+	rng_seed(&ctx.rng, seed);
+	root = clean_path(argv[optind]);
+	make_tree(root);
+	xfree(root);
+
+	return EXIT_SUCCESS;
+}
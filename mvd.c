@@ -1,97 +1,906 @@
-#define _DEFAULT_SOURCE 1
+#define _XOPEN_SOURCE 700
+#ifdef __linux__
+#define _GNU_SOURCE 1			/* for statx, syncfs and renameat2 */
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-#include <err.h>
-#include <errno.h>
-#include <libgen.h>
-#include <limits.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include "filter.h"
+#include "vector.h"
+#include "utils.h"
 
-static char errstr[1024];
+/*
+ * Files are moved in batches. A batch ends when it holds this many
+ * files or the files in it are in this many directories, each of which
+ * is kept open while the batch is moved.
+ */
+#define BATCH_SIZE 16384
+#define BATCH_DIRS 256
 
-int
-mvd(char *file, char *destdir, char *fmt)
+/* renames a worker takes at a time */
+#define RENAME_CHUNK 64
+
+/* number of recently used buckets kept with the times they cover */
+#define BUCKET_CACHE 8
+
+enum time_field { MTIME, CTIME, BTIME };
+
+/* the smallest unit of time a format shows */
+enum unit { SECOND, MINUTE, HOUR, DAY, MONTH, YEAR };
+
+/*
+ * A bucket and the times [lo, hi) which format to its name. The name
+ * is copied to the arena of a batch the first time it is used in it.
+ */
+struct bucket {
+	time_t lo;
+	time_t hi;
+	char name[BUFSIZE];
+	const char *copy;
+	ulong batch;
+	ulong used;
+};
+
+struct entry {
+	const char *path;		/* as given */
+	const char *name;		/* the last component of path */
+	size_t dirlen;			/* length of the directory part */
+	int dir_fd;			/* open directory the name is in */
+	const char *bucket;		/* the directory it moves to */
+	int copied;			/* to another filesystem */
+};
+
+DECLARE_VECTOR(entry_vector, struct entry);
+DEFINE_VECTOR(entry_vector, struct entry);
+
+static struct context {
+	const char *fmt;
+	enum unit unit;
+	enum time_field time_field;
+	const char *destdir;
+	int dest_fd;
+	int files_only;			/* leave directories where they are */
+	struct filter filter;
+
+	/* the buckets made so far, sorted */
+	char **made;
+	size_t nmade;
+
+	/* the batch being moved, its directories and strings */
+	struct entry_vector *batch;
+	int dir_fds[BATCH_DIRS];
+	size_t ndirs;			/* open, or in the batch at most */
+	struct arena *arena;
+	ulong batches;
+
+	struct bucket buckets[BUCKET_CACHE];
+	ulong lookups;
+} ctx;
+
+static void
+usage(void)
 {
-	char target[PATH_MAX], datestr[PATH_MAX];
-	struct stat sb;
+	fputs("usage: mvd [-T] [-f fmt] [-t time] [filters] file [file ...] directory\n"
+	    "       mvd [-T] [-f fmt] [-t time] [filters] -0 directory\n"
+	    "       mvd [-T] [-f fmt] [-t time] [filters] -d source directory\n"
+	    "filters: [-N pattern] [-M from,until] [-Z min,max]\n", stderr);
+	exit(1);
+}
 
-	if (stat(file, &sb) == -1) {
-		snprintf(errstr, sizeof(errstr),
-		    "%s: %s.", file, strerror(errno));
-		return -1;
+static int
+by_dir(const void *entry_a, const void *entry_b)
+{
+	const struct entry *a = entry_a, *b = entry_b;
+	int cmp;
+
+	STATS_COUNT(STATS_COMPARES, 1);
+	cmp = memcmp(a->path, b->path,
+	    a->dirlen < b->dirlen ? a->dirlen : b->dirlen);
+	if (cmp != 0)
+		return cmp;
+	if (a->dirlen != b->dirlen)
+		return a->dirlen < b->dirlen ? -1 : 1;
+
+	return strcmp(a->name, b->name);
+}
+
+static int
+by_bucket(const void *entry_a, const void *entry_b)
+{
+	const struct entry *a = entry_a, *b = entry_b;
+	int cmp;
+
+	STATS_COUNT(STATS_COMPARES, 1);
+	cmp = strcmp(a->bucket, b->bucket);
+
+	return cmp != 0 ? cmp : strcmp(a->name, b->name);
+}
+
+static int
+by_string(const void *str_a, const void *str_b)
+{
+	STATS_COUNT(STATS_COMPARES, 1);
+	return strcmp(*(char *const *)str_a, *(char *const *)str_b);
+}
+
+/*
+ * The smallest unit of time the format shows. Conversions it doesn't
+ * know, like the time zone which changes with daylight saving time,
+ * count as seconds.
+ */
+static enum unit
+format_unit(const char *fmt)
+{
+	enum unit unit = YEAR, conv;
+
+	while ((fmt = strchr(fmt, '%')) != NULL) {
+		/* skip flags, a width and modifiers */
+		++fmt;
+		fmt += strspn(fmt, "_-0^#123456789EO");
+
+		switch (*fmt) {
+		case '\0':
+			return SECOND;
+		case '%': case 'n': case 't':
+			++fmt;
+			continue;
+		case 'C': case 'G': case 'g': case 'Y': case 'y':
+			conv = YEAR;
+			break;
+		case 'B': case 'b': case 'h': case 'm':
+			conv = MONTH;
+			break;
+		case 'A': case 'a': case 'D': case 'd': case 'e': case 'F':
+		case 'j': case 'U': case 'u': case 'V': case 'W': case 'w':
+		case 'x':
+			conv = DAY;
+			break;
+		case 'H': case 'I': case 'k': case 'l': case 'P': case 'p':
+			conv = HOUR;
+			break;
+		case 'M': case 'R':
+			conv = MINUTE;
+			break;
+		default:
+			conv = SECOND;
+			break;
+		}
+
+		if (conv < unit)
+			unit = conv;
+		++fmt;
 	}
 
-	if (strftime(datestr, sizeof(datestr),
-	    fmt, localtime(&sb.st_mtime)) == 0) {
-		snprintf(errstr, sizeof(errstr), "bad format: %s", fmt);
-		return -1;
+	return unit;
+}
+
+static void
+format_time(char *buf, time_t t)
+{
+	struct tm tm;
+
+	if (localtime_r(&t, &tm) == NULL ||
+	    strftime(buf, BUFSIZE, ctx.fmt, &tm) == 0)
+		die("Bad format '%s'.", ctx.fmt);
+}
+
+/*
+ * Find the times around t which format the same as t does, from the
+ * start of its unit to the start of the next one. Only the second t
+ * is in is used when that doesn't check out.
+ */
+static void
+bucket_range(struct bucket *bucket, time_t t)
+{
+	char name[BUFSIZE];
+	struct tm lo, hi;
+
+	localtime_r(&t, &lo);
+	switch (ctx.unit) {
+	case YEAR:
+		lo.tm_mon = 0;
+		/* FALLTHROUGH */
+	case MONTH:
+		lo.tm_mday = 1;
+		/* FALLTHROUGH */
+	case DAY:
+		lo.tm_hour = 0;
+		/* FALLTHROUGH */
+	case HOUR:
+		lo.tm_min = 0;
+		/* FALLTHROUGH */
+	case MINUTE:
+		lo.tm_sec = 0;
+		/* FALLTHROUGH */
+	case SECOND:
+		break;
+	}
+
+	hi = lo;
+	switch (ctx.unit) {
+	case YEAR:
+		++hi.tm_year;
+		break;
+	case MONTH:
+		++hi.tm_mon;
+		break;
+	case DAY:
+		++hi.tm_mday;
+		break;
+	case HOUR:
+		++hi.tm_hour;
+		break;
+	case MINUTE:
+		++hi.tm_min;
+		break;
+	case SECOND:
+		++hi.tm_sec;
+		break;
+	}
+
+	lo.tm_isdst = hi.tm_isdst = -1;
+	bucket->lo = mktime(&lo);
+	bucket->hi = mktime(&hi);
+	format_time(bucket->name, t);
+
+	if (bucket->lo == (time_t)-1 || bucket->hi == (time_t)-1 ||
+	    t < bucket->lo || t >= bucket->hi) {
+		bucket->lo = t;
+		bucket->hi = t + 1;
+		return;
+	}
+
+	/* both ends have to give the same name */
+	format_time(name, bucket->lo);
+	if (strcmp(name, bucket->name) == 0)
+		format_time(name, bucket->hi - 1);
+	if (strcmp(name, bucket->name) != 0) {
+		bucket->lo = t;
+		bucket->hi = t + 1;
+	}
+}
+
+/*
+ * The name of the bucket for time t, which stays around until the
+ * batch is moved. Files tend to come with times close together so
+ * most of them fall in the range of a recently used bucket, which
+ * needs no time conversion.
+ */
+static const char *
+bucket_name(time_t t)
+{
+	struct bucket *bucket = NULL;
+	size_t i;
+
+	for (i = 0; i < BUCKET_CACHE; ++i) {
+		struct bucket *b = &ctx.buckets[i];
+
+		if (b->used != 0 && t >= b->lo && t < b->hi) {
+			bucket = b;
+			break;
+		}
+
+		/* replace the least recently used one */
+		if (bucket == NULL || b->used < bucket->used)
+			bucket = b;
+	}
+
+	if (i == BUCKET_CACHE) {
+		bucket_range(bucket, t);
+		bucket->copy = NULL;
+	}
+
+	bucket->used = ++ctx.lookups;
+	if (bucket->copy == NULL || bucket->batch != ctx.batches) {
+		bucket->copy = arena_strdup(ctx.arena, bucket->name);
+		bucket->batch = ctx.batches;
+	}
+
+	return bucket->copy;
+}
+
+/*
+ * The time of a file used for its bucket, birth times come from statx
+ * in the same call. Returns FALSE if the file should be left alone, a
+ * directory with -d or a file the filters don't pass.
+ */
+static int
+file_time(struct entry *entry, time_t *t)
+{
+	struct walk_entry ent;
+	struct stat st;
+
+	STATS_COUNT(STATS_STATS, 1);
+#ifdef STATX_BTIME
+	if (ctx.time_field == BTIME) {
+		struct statx stx;
+
+		if (statx(entry->dir_fd, entry->name, 0, STATX_TYPE |
+		    STATX_SIZE | STATX_MTIME | STATX_BTIME, &stx) == -1)
+			die("Can't stat '%s':", entry->path);
+		if (!(stx.stx_mask & STATX_BTIME))
+			die("'%s' has no birth time.", entry->path);
+
+		/* what the filters look at */
+		memset(&st, 0, sizeof(st));
+		st.st_mode = stx.stx_mode;
+		st.st_size = stx.stx_size;
+		st.st_mtime = stx.stx_mtime.tv_sec;
+		*t = stx.stx_btime.tv_sec;
+	} else
+#endif
+	{
+		if (fstatat(entry->dir_fd, entry->name, &st, 0) == -1)
+			die("Can't stat '%s':", entry->path);
+
+		*t = ctx.time_field == CTIME ? st.st_ctime : st.st_mtime;
 	}
 
-	snprintf(target, sizeof(target), "%s/%s", destdir, datestr);
-	if (mkdir(target, 0700) == -1) {
-		if (errno != EEXIST) {
-			snprintf(errstr, sizeof(errstr),
-			    "mkdir %s: %s.", target, strerror(errno));
-			return -1;
+	if (ctx.files_only && S_ISDIR(st.st_mode))
+		return FALSE;
+
+	memset(&ent, 0, sizeof(ent));
+	ent.path = entry->path;
+	ent.name = entry->name;
+	ent.namelen = strlen(entry->name);
+	ent.st = &st;
+
+	return filter_match(&ctx.filter, &ent);
+}
+
+/*
+ * Open the directory of every file in the batch once and stat the
+ * files relative to it, then format the bucket each file goes to.
+ */
+static void
+stat_batch(void)
+{
+	const char *dir_path = NULL;
+	size_t i, n, dir_len = 0;
+
+	qsort(ctx.batch->items, ctx.batch->size, sizeof(struct entry),
+	    by_dir);
+
+	ctx.ndirs = 0;
+	for (i = n = 0; i < ctx.batch->size; ++i) {
+		struct entry *entry = &ctx.batch->items[i];
+		time_t t;
+
+		if (dir_path == NULL || dir_len != entry->dirlen ||
+		    memcmp(dir_path, entry->path, dir_len) != 0) {
+			char *dir;
+			int fd;
+
+			dir = entry->dirlen == 0 ? xstrdup(".") :
+			    xcalloc(1, entry->dirlen + 1);
+			if (entry->dirlen > 0)
+				memcpy(dir, entry->path, entry->dirlen);
+
+			fd = open(dir, O_RDONLY | O_DIRECTORY);
+			if (fd == -1)
+				die("Can't open '%s':", dir);
+			xfree(dir);
+
+			ctx.dir_fds[ctx.ndirs++] = fd;
+			dir_path = entry->path;
+			dir_len = entry->dirlen;
+		}
+		entry->dir_fd = ctx.dir_fds[ctx.ndirs - 1];
+
+		if (!file_time(entry, &t))
+			continue;
+
+		entry->bucket = bucket_name(t);
+
+		/* keep what is moved at the front */
+		ctx.batch->items[n++] = *entry;
+	}
+
+	ctx.batch->size = n;
+}
+
+/*
+ * Make the buckets of a batch which weren't made before, each of them
+ * only once. Files of the batch which would end up with the same name
+ * in a bucket are refused before anything is moved.
+ */
+static void
+make_buckets(void)
+{
+	size_t i, nmade = ctx.nmade;
+
+	qsort(ctx.batch->items, ctx.batch->size, sizeof(struct entry),
+	    by_bucket);
+
+	for (i = 0; i < ctx.batch->size; ++i) {
+		const struct entry *entry = &ctx.batch->items[i];
+		const char *bucket = entry->bucket;
+
+		if (i > 0 && strcmp(entry[-1].bucket, bucket) == 0) {
+			if (strcmp(entry[-1].name, entry->name) == 0)
+				die("Both '%s' and '%s' move to '%s/%s/%s'.",
+				    entry[-1].path, entry->path, ctx.destdir,
+				    bucket, entry->name);
+			continue;
 		}
+
+		if (bsearch(&bucket, ctx.made, nmade, sizeof(ctx.made[0]),
+		    by_string) != NULL)
+			continue;
+
+		if (mkdirat(ctx.dest_fd, bucket, 0700) == -1 &&
+		    errno != EEXIST)
+			die("Can't make directory '%s/%s':", ctx.destdir,
+			    bucket);
+
+		ctx.made = xrealloc(ctx.made,
+		    (ctx.nmade + 1) * sizeof(ctx.made[0]));
+		ctx.made[ctx.nmade++] = xstrdup(bucket);
 	}
 
-	snprintf(target, sizeof(target),
-	    "%s/%s/%s", destdir, datestr, basename(file));
-	if (rename(file, target) == -1) {
-		snprintf(errstr, sizeof(errstr),
-		    "rename %s to %s: %s.", file, target, strerror(errno));
+	if (ctx.nmade > nmade)
+		qsort(ctx.made, ctx.nmade, sizeof(ctx.made[0]), by_string);
+}
+
+/*
+ * Rename a file without replacing one which is there already, which
+ * renameat2 does at once. Without it, or where the filesystem doesn't
+ * support it, a file is linked and unlinked which fails the same way.
+ * Where that can't be done either, like for a directory or on a
+ * filesystem without hard links, it is renamed only if there is nothing
+ * by that name yet.
+ */
+static int
+rename_new(int from_fd, const char *from, int to_fd, const char *to)
+{
+	struct stat st;
+	int saved_errno;
+
+#ifdef RENAME_NOREPLACE
+	if (renameat2(from_fd, from, to_fd, to, RENAME_NOREPLACE) == 0)
+		return 0;
+	if (errno != EINVAL)
+		return -1;
+#endif
+	if (linkat(from_fd, from, to_fd, to, 0) == 0)
+		return unlinkat(from_fd, from, 0);
+	if (errno != EPERM && errno != EISDIR)
+		return -1;
+
+	saved_errno = errno;
+	if (fstatat(to_fd, to, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+		errno = EEXIST;
 		return -1;
 	}
+	if (errno != ENOENT)
+		return -1;
+	errno = saved_errno;
 
-	return 0;
+	return renameat(from_fd, from, to_fd, to);
 }
 
-void
-usage(void)
+/*
+ * Copy a file to another filesystem, a symbolic link is made again
+ * instead of copying what it points to. Like rename_new this doesn't
+ * replace a target which is there already.
+ */
+static int
+copy_new(const struct entry *entry, const char *target)
 {
-	fputs("usage: mvd [-f fmt] file [file ...] directory\n", stderr);
-	exit(1);
+	struct timespec times[2];
+	struct stat st;
+	char *link = NULL;
+	size_t size;
+	ssize_t len;
+	int ok, saved_errno;
+
+	if (fstatat(entry->dir_fd, entry->name, &st, AT_SYMLINK_NOFOLLOW) ==
+	    -1)
+		return FALSE;
+	if (!S_ISLNK(st.st_mode))
+		return copy_file_at(entry->dir_fd, entry->name, ctx.dest_fd,
+		    target);
+
+	/* the size of a link can be 0 when the filesystem doesn't know */
+	size = st.st_size < 255 ? 256 : (size_t)st.st_size + 1;
+	for (;;) {
+		link = xrealloc(link, size);
+		len = readlinkat(entry->dir_fd, entry->name, link, size);
+		if (len == -1 || (size_t)len < size)
+			break;
+		size *= 2;
+	}
+
+	ok = len != -1;
+	if (ok) {
+		link[len] = '\0';
+		times[0] = st.st_atim;
+		times[1] = st.st_mtim;
+		ok = symlinkat(link, ctx.dest_fd, target) == 0;
+		if (ok && utimensat(ctx.dest_fd, target, times,
+		    AT_SYMLINK_NOFOLLOW) == -1) {
+			saved_errno = errno;
+			unlinkat(ctx.dest_fd, target, 0);
+			errno = saved_errno;
+			ok = FALSE;
+		}
+	}
+
+	saved_errno = errno;
+	xfree(link);
+	errno = saved_errno;
+
+	return ok;
 }
 
-int
-isdir(const char *name)
+struct mover {
+	pthread_mutex_t lock;
+	size_t next;
+};
+
+static void *
+move_worker(void *mover_ptr)
+{
+	struct mover *mover = mover_ptr;
+	char *target = NULL;
+	size_t targetsize = 0;
+
+	for (;;) {
+		size_t i, first, last;
+
+		pthread_mutex_lock(&mover->lock);
+		first = mover->next;
+		mover->next += RENAME_CHUNK;
+		pthread_mutex_unlock(&mover->lock);
+
+		if (first >= ctx.batch->size)
+			break;
+
+		last = first + RENAME_CHUNK;
+		if (last > ctx.batch->size)
+			last = ctx.batch->size;
+
+		for (i = first; i < last; ++i) {
+			struct entry *entry = &ctx.batch->items[i];
+			size_t len;
+
+			len = strlen(entry->bucket) + strlen(entry->name) + 2;
+			if (len > targetsize) {
+				targetsize = len * 2;
+				target = xrealloc(target, targetsize);
+			}
+			sprintf(target, "%s/%s", entry->bucket, entry->name);
+
+			if (rename_new(entry->dir_fd, entry->name, ctx.dest_fd,
+			    target) == 0)
+				continue;
+
+			/* copy it over when it's on another filesystem */
+			if (errno != EXDEV)
+				die("Can't rename '%s' to '%s/%s':",
+				    entry->path, ctx.destdir, target);
+			if (!copy_new(entry, target))
+				die("Can't copy '%s' to '%s/%s':",
+				    entry->path, ctx.destdir, target);
+			entry->copied = TRUE;
+		}
+	}
+
+	xfree(target);
+
+	return NULL;
+}
+
+#ifndef __linux__
+static void
+sync_at(const char *path)
+{
+	int fd;
+
+	fd = openat(ctx.dest_fd, path, O_RDONLY);
+	if (fd == -1 || fsync(fd) == -1)
+		die("Can't sync '%s/%s':", ctx.destdir, path);
+	close(fd);
+}
+#endif
+
+/*
+ * Remove the files of the batch which were copied, once the copies
+ * are on disk. On Linux the filesystem they are on is synced at once,
+ * elsewhere every copy and bucket is synced by itself.
+ */
+static void
+remove_copied(void)
+{
+	char *target = NULL;
+	size_t i, ncopied = 0;
+
+	for (i = 0; i < ctx.batch->size; ++i)
+		if (ctx.batch->items[i].copied)
+			++ncopied;
+
+	if (ncopied == 0)
+		return;
+
+#ifdef __linux__
+	if (syncfs(ctx.dest_fd) == -1)
+		die("Can't sync '%s':", ctx.destdir);
+#else
+	/* the batch is sorted by bucket */
+	for (i = 0; i < ctx.batch->size; ++i) {
+		struct entry *entry = &ctx.batch->items[i];
+
+		target = xrealloc(target, strlen(entry->bucket) +
+		    strlen(entry->name) + 2);
+		if (entry->copied) {
+			sprintf(target, "%s/%s", entry->bucket, entry->name);
+			sync_at(target);
+		}
+
+		if (i == 0 || strcmp(entry->bucket,
+		    ctx.batch->items[i - 1].bucket) != 0) {
+			strcpy(target, entry->bucket);
+			sync_at(target);
+		}
+	}
+#endif
+
+	for (i = 0; i < ctx.batch->size; ++i) {
+		struct entry *entry = &ctx.batch->items[i];
+
+		if (entry->copied &&
+		    unlinkat(entry->dir_fd, entry->name, 0) == -1)
+			die("Can't remove '%s':", entry->path);
+	}
+
+	xfree(target);
+}
+
+/*
+ * Move a batch. Everything is stat'ed first, the buckets are made
+ * once and then a thread per cpu renames the files, a chunk of them
+ * at a time.
+ */
+static void
+move_batch(void)
+{
+	struct mover mover;
+	pthread_t *threads;
+	int n, nthreads;
+	size_t i;
+
+	if (ctx.batch->size == 0)
+		return;
+
+	stats_phase("stat");
+	stat_batch();
+	stats_phase("mkdir");
+	make_buckets();
+
+	stats_phase("move");
+	pthread_mutex_init(&mover.lock, NULL);
+	mover.next = 0;
+
+	nthreads = cpu_count();
+	if ((size_t)nthreads > (ctx.batch->size + RENAME_CHUNK - 1) /
+	    RENAME_CHUNK)
+		nthreads = (ctx.batch->size + RENAME_CHUNK - 1) / RENAME_CHUNK;
+
+	threads = xcalloc(nthreads, sizeof(threads[0]));
+	for (n = 0; n < nthreads; ++n)
+		if (pthread_create(&threads[n], NULL, move_worker,
+		    &mover) != 0)
+			die("Can't create move thread.");
+
+	for (n = 0; n < nthreads; ++n)
+		pthread_join(threads[n], NULL);
+
+	pthread_mutex_destroy(&mover.lock);
+	xfree(threads);
+
+	stats_phase("sync");
+	remove_copied();
+
+	for (i = 0; i < ctx.ndirs; ++i)
+		close(ctx.dir_fds[i]);
+	ctx.ndirs = 0;
+	ctx.batch->size = 0;
+
+	arena_free(ctx.arena);
+	ctx.arena = arena_new();
+	++ctx.batches;
+	stats_phase("read");
+}
+
+/*
+ * Add a file to the batch, moving the batch first if it is full. The
+ * path has to stay around until the batch is moved.
+ */
+static void
+add_file(char *path)
+{
+	struct entry *entry, *prev = NULL;
+	char *slash;
+	size_t len = strlen(path);
+
+	/* a directory can be given with a trailing slash */
+	while (len > 1 && path[len - 1] == '/')
+		path[--len] = '\0';
+
+	slash = strrchr(path, '/');
+	entry = entry_vector_push(ctx.batch);
+	if (ctx.batch->size > 1)
+		prev = entry - 1;
+	entry->path = path;
+	entry->name = slash == NULL ? path : slash + 1;
+	entry->dirlen = slash == NULL ? 0 : (size_t)(slash - path) + 1;
+	entry->bucket = NULL;
+	entry->copied = FALSE;
+
+	if (entry->name[0] == '\0')
+		die("Can't move '%s'.", path);
+	STATS_COUNT(STATS_FILES, 1);
+
+	/* at most this many directories, likely a lot less */
+	if (prev == NULL || prev->dirlen != entry->dirlen ||
+	    memcmp(prev->path, entry->path, entry->dirlen) != 0)
+		++ctx.ndirs;
+
+	if (ctx.batch->size == BATCH_SIZE || ctx.ndirs == BATCH_DIRS)
+		move_batch();
+}
+
+/* move the NUL terminated paths read from stdin, like find -print0 */
+static void
+read_stdin(void)
+{
+	char *line = NULL;
+	size_t linesize = 0;
+	ssize_t len;
+
+	while ((len = getdelim(&line, &linesize, '\0', stdin)) != -1) {
+		if (len > 0 && line[len - 1] == '\0')
+			--len;
+		if (len == 0)
+			continue;
+
+		add_file(arena_strndup(ctx.arena, line, len));
+	}
+
+	if (ferror(stdin))
+		die("Can't read stdin:");
+
+	xfree(line);
+}
+
+/* move the files in the directory source, leaving its subdirectories */
+static void
+scan_dir(const char *source)
 {
-	struct stat sb;
+	struct dirent *dent;
+	DIR *dir;
+
+	dir = opendir(source);
+	if (dir == NULL)
+		die("Can't open '%s':", source);
+
+	ctx.files_only = TRUE;
+	while ((errno = 0, dent = readdir(dir)) != NULL) {
+		char *path;
+
+		if (strcmp(dent->d_name, ".") == 0 ||
+		    strcmp(dent->d_name, "..") == 0)
+			continue;
+
+		path = arena_alloc(ctx.arena, strlen(source) +
+		    strlen(dent->d_name) + 2);
+		sprintf(path, "%s/%s", source, dent->d_name);
+		add_file(path);
+	}
 
-	if (stat(name, &sb) == -1)
-		errx(1, "%s: %s", name, strerror(errno));
+	if (errno != 0)
+		die("Can't read '%s':", source);
 
-	return S_ISDIR(sb.st_mode);
+	closedir(dir);
 }
 
 int
 main(int argc, char **argv)
 {
-	char *destdir = argv[argc - 1], *fmt = "%Y%m";
-	int i, opt;
+	char *source = NULL;
+	struct stat st;
+	int i, opt, from_stdin = FALSE;
 
-	while ((opt = getopt(argc, argv, "f:")) != -1) {
+	ctx.fmt = "%Y%m";
+	filter_init(&ctx.filter);
+	while ((opt = getopt(argc, argv, "0d:f:M:N:t:TZ:")) != -1) {
 		switch (opt) {
+		case '0':
+			from_stdin = TRUE;
+			break;
+		case 'd':
+			source = optarg;
+			break;
 		case 'f':
-			fmt = optarg;
+			ctx.fmt = optarg;
+			break;
+		case 'M':
+		case 'N':
+		case 'Z':
+			if (!filter_option(&ctx.filter, opt, optarg))
+				usage();
+			break;
+		case 't':
+			if (strcmp(optarg, "mtime") == 0)
+				ctx.time_field = MTIME;
+			else if (strcmp(optarg, "ctime") == 0)
+				ctx.time_field = CTIME;
+			else if (strcmp(optarg, "birth") == 0)
+				ctx.time_field = BTIME;
+			else
+				usage();
+			break;
+		case 'T':
+			stats_start();
 			break;
 		default:
 			usage();
 		}
 	}
 
-	if (optind >= argc || !isdir(destdir))
+	if (optind >= argc)
 		usage();
 
-	for (i = optind; i < argc - 1; ++i) {
-		if (mvd(argv[i], destdir, fmt) == -1)
-			errx(1, "%s", errstr);
-	}
+#ifndef STATX_BTIME
+	if (ctx.time_field == BTIME)
+		die("Birth times are not supported here.");
+#endif
+	ctx.unit = format_unit(ctx.fmt);
+
+	/* files come from either stdin, a directory or the arguments */
+	if ((from_stdin || source != NULL) &&
+	    (optind != argc - 1 || (from_stdin && source != NULL)))
+		usage();
+
+	ctx.destdir = argv[argc - 1];
+	if (stat(ctx.destdir, &st) == -1)
+		die("Can't stat '%s':", ctx.destdir);
+	if (!S_ISDIR(st.st_mode))
+		usage();
+
+	ctx.dest_fd = open(ctx.destdir, O_RDONLY | O_DIRECTORY);
+	if (ctx.dest_fd == -1)
+		die("Can't open '%s':", ctx.destdir);
+
+	ctx.batch = entry_vector_new();
+	ctx.arena = arena_new();
+	stats_phase("read");
+	if (from_stdin)
+		read_stdin();
+	else if (source != NULL)
+		scan_dir(source);
+	else
+		for (i = optind; i < argc - 1; ++i)
+			add_file(argv[i]);
+	move_batch();
+
+	for (i = 0; (size_t)i < ctx.nmade; ++i)
+		xfree(ctx.made[i]);
+	xfree(ctx.made);
+	entry_vector_free(ctx.batch);
+	arena_free(ctx.arena);
+	filter_free(&ctx.filter);
+	close(ctx.dest_fd);
 
 	return 0;
 }
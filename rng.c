@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include "rng.h"
+
+static uint64_t
+rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+void
+rng_seed(struct rng *rng, uint64_t seed)
+{
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		uint64_t z;
+
+		seed += UINT64_C(0x9e3779b97f4a7c15);
+		z = seed;
+		z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+		z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+		rng->s[i] = z ^ (z >> 31);
+	}
+}
+
+uint64_t
+rng_next(struct rng *rng)
+{
+	uint64_t *s = rng->s;
+	uint64_t result, t;
+
+	result = rotl(s[1] * 5, 7) * 9;
+	t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+
+	return result;
+}
+
+/*
+ * A uniform random number below n, which must not be 0. Small ranges
+ * use Lemire's multiply and reject method, C89 has no 128 bit product
+ * so larger ones reject from a power of two mask instead.
+ */
+uint64_t
+rng_below(struct rng *rng, uint64_t n)
+{
+	uint64_t mask, x;
+
+	if (n <= UINT32_MAX) {
+		uint64_t m;
+		uint32_t low;
+
+		m = (rng_next(rng) >> 32) * n;
+		low = (uint32_t)m;
+		if (low < n) {
+			uint32_t threshold = (uint32_t)(-(uint32_t)n) % n;
+
+			while (low < threshold) {
+				m = (rng_next(rng) >> 32) * n;
+				low = (uint32_t)m;
+			}
+		}
+
+		return m >> 32;
+	}
+
+	mask = n - 1;
+	mask |= mask >> 1;
+	mask |= mask >> 2;
+	mask |= mask >> 4;
+	mask |= mask >> 8;
+	mask |= mask >> 16;
+	mask |= mask >> 32;
+
+	do
+		x = rng_next(rng) & mask;
+	while (x >= n);
+
+	return x;
+}
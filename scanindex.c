@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 600
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scanindex.h"
+#include "vector.h"
+#include "utils.h"
+
+/* size of the stdio buffer used when writing an index */
+#define WRITE_BUFSIZE (1024 * 1024)
+
+/*
+ * Open the index at path. A missing or damaged index, or one built
+ * with different walk flags, opens as an empty index.
+ */
+struct scanindex *
+scanindex_open(const char *path, int flags)
+{
+	const struct scanindex_header *header;
+	struct scanindex *index;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	index = xcalloc(1, sizeof(*index));
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return index;
+
+	if (fstat(fd, &st) == -1 ||
+	    (size_t)st.st_size < sizeof(struct scanindex_header)) {
+		close(fd);
+		return index;
+	}
+
+	index->mapsize = st.st_size;
+	index->map = mmap(NULL, index->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (index->map == MAP_FAILED) {
+		index->map = NULL;
+		return index;
+	}
+
+	header = index->map;
+	size = index->mapsize - sizeof(*header);
+	if (memcmp(header->magic, SCANINDEX_MAGIC, sizeof(header->magic)) ||
+	    header->flags != (uint64_t)flags ||
+	    header->ndirs > size / sizeof(struct scanindex_dir) ||
+	    header->nentries > size / sizeof(struct scanindex_file) ||
+	    header->ndirs * sizeof(struct scanindex_dir) +
+	    header->nentries * sizeof(struct scanindex_file) +
+	    header->strsize != size) {
+		munmap(index->map, index->mapsize);
+		index->map = NULL;
+		return index;
+	}
+
+	index->header = header;
+	index->dirs = (const struct scanindex_dir *)(header + 1);
+	index->entries = (const struct scanindex_file *)
+	    (index->dirs + header->ndirs);
+	index->strings = (const char *)(index->entries + header->nentries);
+
+	return index;
+}
+
+/*
+ * Find an indexed directory which still has the given modification
+ * time. Directories modified in the second the index was built might
+ * have changed after they were read and are never returned.
+ */
+const struct scanindex_dir *
+scanindex_find(const struct scanindex *index, const char *path,
+    uint64_t mtime)
+{
+	const struct scanindex_header *header = index->header;
+	size_t lo, hi;
+
+	if (header == NULL)
+		return NULL;
+
+	lo = 0;
+	hi = header->ndirs;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct scanindex_dir *dir = &index->dirs[mid];
+		int cmp;
+
+		if (dir->path >= header->strsize)
+			return NULL;
+
+		cmp = strcmp(index->strings + dir->path, path);
+		if (cmp == 0) {
+			if (dir->mtime != mtime || dir->mtime >= header->created)
+				return NULL;
+			if (dir->first > header->nentries ||
+			    dir->count > header->nentries - dir->first)
+				return NULL;
+
+			return dir;
+		}
+
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+void
+scanindex_close(struct scanindex *index)
+{
+	if (index->map != NULL)
+		munmap(index->map, index->mapsize);
+
+	xfree(index);
+}
+
+static int
+by_path(const void *record_a, const void *record_b)
+{
+	const struct scanindex_record *a, *b;
+
+	a = *(const struct scanindex_record *const *)record_a;
+	b = *(const struct scanindex_record *const *)record_b;
+
+	return strcmp(a->path, b->path);
+}
+
+/*
+ * Write the directories read by a walk to a new index at path.
+ * Returns FALSE if the index could not be written.
+ */
+int
+scanindex_write(const char *path, struct vector *records, uint64_t created,
+    int flags)
+{
+	struct scanindex_header header;
+	uint64_t first, strsize;
+	char *tmppath;
+	size_t i, j;
+	FILE *fp;
+	int ok;
+
+	qsort(records->items, records->size, sizeof(records->items[0]),
+	    by_path);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCANINDEX_MAGIC, sizeof(header.magic));
+	header.created = created;
+	header.flags = flags;
+	header.ndirs = records->size;
+	for (i = 0; i < records->size; ++i) {
+		struct scanindex_record *record = records->items[i];
+
+		header.nentries += record->entries->size;
+		header.strsize += strlen(record->path) + 1;
+		for (j = 0; j < record->entries->size; ++j) {
+			struct scanindex_entry *entry;
+
+			entry = record->entries->items[j];
+			header.strsize += strlen(entry->name) + 1;
+		}
+	}
+
+	tmppath = xcalloc(1, strlen(path) + 32);
+	sprintf(tmppath, "%s.%lu.tmp", path, (ulong) getpid());
+
+	fp = fopen(tmppath, "wb");
+	if (fp == NULL) {
+		xfree(tmppath);
+		return FALSE;
+	}
+	setvbuf(fp, NULL, _IOFBF, WRITE_BUFSIZE);
+
+	ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+	/* strings are laid out as the directory path and its entries */
+	first = strsize = 0;
+	for (i = 0; i < records->size && ok; ++i) {
+		struct scanindex_record *record = records->items[i];
+		struct scanindex_dir dir;
+
+		dir.path = strsize;
+		dir.mtime = record->mtime;
+		dir.first = first;
+		dir.count = record->entries->size;
+		ok = fwrite(&dir, sizeof(dir), 1, fp) == 1;
+
+		strsize += strlen(record->path) + 1;
+		for (j = 0; j < record->entries->size; ++j) {
+			struct scanindex_entry *entry;
+
+			entry = record->entries->items[j];
+			strsize += strlen(entry->name) + 1;
+		}
+		first += record->entries->size;
+	}
+
+	strsize = 0;
+	for (i = 0; i < records->size && ok; ++i) {
+		struct scanindex_record *record = records->items[i];
+
+		strsize += strlen(record->path) + 1;
+		for (j = 0; j < record->entries->size && ok; ++j) {
+			struct scanindex_entry *entry;
+			struct scanindex_file file;
+
+			entry = record->entries->items[j];
+			file.name = strsize;
+			file.size = entry->size;
+			file.blocks = entry->blocks;
+			file.mtime = entry->mtime;
+			file.dev = entry->dev;
+			file.ino = entry->ino;
+			file.type = entry->type;
+			ok = fwrite(&file, sizeof(file), 1, fp) == 1;
+
+			strsize += strlen(entry->name) + 1;
+		}
+	}
+
+	for (i = 0; i < records->size && ok; ++i) {
+		struct scanindex_record *record = records->items[i];
+
+		ok = fwrite(record->path, 1, strlen(record->path) + 1, fp) ==
+		    strlen(record->path) + 1;
+		for (j = 0; j < record->entries->size && ok; ++j) {
+			struct scanindex_entry *entry;
+			size_t len;
+
+			entry = record->entries->items[j];
+			len = strlen(entry->name) + 1;
+			ok = fwrite(entry->name, 1, len, fp) == len;
+		}
+	}
+
+	if (fclose(fp) != 0)
+		ok = FALSE;
+
+	if (!ok || rename(tmppath, path) == -1) {
+		unlink(tmppath);
+		ok = FALSE;
+	}
+
+	xfree(tmppath);
+
+	return ok;
+}
+
+/*
+ * Free a vector of records, the strings they point to belong to the
+ * arena of the walk.
+ */
+void
+scanindex_records_free(struct vector *records)
+{
+	size_t i;
+
+	for (i = 0; i < records->size; ++i) {
+		struct scanindex_record *record = records->items[i];
+
+		vector_free(record->entries);
+	}
+
+	vector_free(records);
+}
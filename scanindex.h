@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SCANINDEX_H
+#define SCANINDEX_H
+
+#include <stdint.h>
+
+/*
+ * An index of the directories a walk has read.
+ *
+ * The index file holds a header, directory records sorted by path,
+ * the entries of those directories and a string table. It is mapped
+ * into memory as is. A directory whose modification time didn't
+ * change since it was indexed doesn't need to be read again.
+ */
+#define SCANINDEX_MAGIC "SCANIDX2"
+
+struct vector;
+
+struct scanindex_header {
+	char magic[8];
+	uint64_t created;		/* when the walk started */
+	uint64_t flags;			/* WALK_PHYS if links weren't followed */
+	uint64_t ndirs;
+	uint64_t nentries;
+	uint64_t strsize;
+};
+
+struct scanindex_dir {
+	uint64_t path;			/* offset in the string table */
+	uint64_t mtime;
+	uint64_t first;			/* first entry of this directory */
+	uint64_t count;
+};
+
+struct scanindex_file {
+	uint64_t name;			/* offset in the string table */
+	uint64_t size;
+	uint64_t blocks;		/* of 512 bytes, as st_blocks */
+	uint64_t mtime;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t type;			/* WALK_F, WALK_D, ... */
+};
+
+struct scanindex {
+	void *map;
+	size_t mapsize;
+	const struct scanindex_header *header;
+	const struct scanindex_dir *dirs;
+	const struct scanindex_file *entries;
+	const char *strings;
+};
+
+/* a directory read during a walk, to be written to a new index */
+struct scanindex_record {
+	const char *path;
+	uint64_t mtime;
+	struct vector *entries;		/* of struct scanindex_entry */
+};
+
+struct scanindex_entry {
+	const char *name;
+	uint64_t size;
+	uint64_t blocks;
+	uint64_t mtime;
+	uint64_t dev;
+	uint64_t ino;
+	int type;
+};
+
+struct scanindex *scanindex_open(const char *, int);
+const struct scanindex_dir *scanindex_find(const struct scanindex *,
+    const char *, uint64_t);
+void scanindex_close(struct scanindex *);
+int scanindex_write(const char *, struct vector *, uint64_t, int);
+void scanindex_records_free(struct vector *);
+
+#endif
@@ -14,30 +14,70 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-static const char *const usage_string = "\
-usage:  shuffle [-p starting path] -e extension | -t media-type command\n\
+/* split in parts, C89 doesn't guarantee longer string literals */
+static const char *const usage_string[] = { "\
+usage:  shuffle [-CTvx] [-b size] [-i index] [-j jobs] [-n files] [-p path]\n\
+        [-s window] [-S seed] [-e extension[,extension ...]] [-N pattern]\n\
+        [-M from,until] [-Z min,max] [-t media-type] command\n\
 \n\
+", "\
 options:\n\
+  -b size        Determine the media type from the first size bytes.\n\
+  -C             Don't use the media type cache.\n\
+  -i index       Keep an index of the path in this file and only\n\
+                 read the directories that changed since.\n\
+", "\
+  -j jobs        Run this many commands at the same time.\n\
+  -n files       Pass up to this many files to each command,\n\
+                 0 passes as many as fit on a command line.\n\
+", "\
   -p path        Starts the search from this path.\n\
-  -e extension   Search for files with this extension.\n\
+  -s window      Start playing while still searching, once this\n\
+                 many files have been found.\n\
+", "\
+  -S seed        Shuffle with this seed, the same seed and files\n\
+                 give the same order.\n\
+  -e extension   Search for files with this extension, or any in a\n\
+                 comma separated list like sid,mus,prg or mp?.\n\
   -t media-type  Search for files with this media type.\n\
+", "\
+  -N pattern     Search for files with a name matching this pattern.\n\
+  -M from,until  Search for files modified from this up to this local\n\
+                 time like 2024-01-31 [12:00[:00]].\n\
+  -Z min,max     Search for files with a size in this range.\n\
+  -T             Print the time spent in each phase and counters\n\
+                 to stderr.\n\
   -v             Show what's being done.\n\
+  -x             Stop starting commands once one has failed.\n\
   command        The command to run for each file.\n\
-\n\
+\n", "\
   The command to run can include a % character which\n\
   is replaced by the filename. If this is omitted\n\
   the filename is appended to the command.\n\
-\n";
+\n\
+  At least one of -e, -N, -M, -Z or -t has to be given.\n\
+  Extensions and patterns ignore case, a file has to\n\
+  match one of them. If they are combined with other\n\
+  filters or a media type a file has to match all.\n\
+\n", "\
+  While searching with -s every file is picked at random\n\
+  from at least window files found so far. Once the search\n\
+  is done the remaining files are played in random order.\n\
+  This order can't be repeated with -S.\n\
+\n" };
 
 #define _XOPEN_SOURCE 600
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
-#include <dirent.h>
-#include <ftw.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <unistd.h>
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,93 +86,597 @@ options:\n\
 
 #include <magic.h>
 
+#include "filter.h"
+#include "typecache.h"
 #include "vector.h"
 #include "utils.h"
 
-static struct context {
-	magic_t mcookie;
+extern char **environ;
 
+static struct context {
 	char *type;
-	char *ext;
+	struct filter filter;
+	size_t header_size;
+	struct typecache *cache;
+	int use_cache;
+	char *index_path;
 
 	char **cmd;
+	int cmdlen;
 	int pos;
+	char **argv;
+	size_t argv_size;
+	size_t batch;
 
 	int verbose;
+	int jobs;
+	int stop_on_failure;
+	int seeded;
+
+	/* while streaming files is shared with the walk */
+	int stream;
+	size_t window;
+	pthread_mutex_t lock;
+	pthread_cond_t found;
+	int walk_done;
+	magic_t mcookie;
+	char *header;
 
 	struct vector *files;
+	size_t next;
+	size_t played;
+	struct arena *arena;
 } ctx;
 
 static int
-collect_files(const char *fpath, const struct stat *st, int type,
-    struct FTW *ftwbuf)
+type_matches(const char *type)
 {
-	int playable = FALSE;
+	return strncmp(ctx.type, type, strlen(ctx.type)) == 0;
+}
 
-	/* these parameters are unused */
-	(void)st;
-	(void)ftwbuf;
+/* a file waiting to be classified */
+struct candidate {
+	char *path;
+	struct typecache_key key;
+};
+
+/*
+ * Hand a file to the player right away when streaming, otherwise keep
+ * it with the rest of the results of this walk thread.
+ */
+static void
+add_file(struct walk_out *out, void *file)
+{
+	if (!ctx.stream) {
+		vector_add(out->items, file);
+		return;
+	}
 
+	pthread_mutex_lock(&ctx.lock);
+	vector_add(ctx.files, file);
+	pthread_cond_signal(&ctx.found);
+	pthread_mutex_unlock(&ctx.lock);
+}
+
+/* libmagic calls all empty files the same */
+static int
+may_match_type(const struct walk_entry *ent, void *unused)
+{
+	(void)unused;
+
+	return ent->st->st_size != 0 || type_matches("inode/x-empty");
+}
+
+/*
+ * Only cheap checks are done while walking, files which need to be
+ * looked at by libmagic are classified afterwards. Until then they
+ * are collected as candidates instead of plain paths.
+ */
+static void
+collect_files(struct walk_out *out, const struct walk_entry *ent)
+{
 	/* skip non regular files */
-	if (type != FTW_F)
-		return 0;
+	if (ent->type != WALK_F)
+		return;
+
+	if (!filter_match(&ctx.filter, ent))
+		return;
+
+	if (ctx.type != NULL) {
+		struct candidate *candidate;
+
+		candidate = arena_alloc(out->arena, sizeof(*candidate));
+		candidate->path = arena_strdup(out->arena, ent->path);
+		candidate->key.dev = ent->st->st_dev;
+		candidate->key.ino = ent->st->st_ino;
+		candidate->key.mtime = ent->st->st_mtime;
+		candidate->key.size = ent->st->st_size;
+		add_file(out, candidate);
+	} else
+		add_file(out, arena_strdup(out->arena, ent->path));
+}
+
+static magic_t
+open_magic(void)
+{
+	magic_t mcookie;
+
+	mcookie = magic_open(MAGIC_MIME);
+	if (mcookie == NULL)
+		die("Can't open libmagic.");
+
+	if (magic_load(mcookie, NULL) == -1)
+		die("%s.", magic_error(mcookie));
+
+	return mcookie;
+}
+
+/* number of files a classify thread takes at a time */
+#define CLASSIFY_BATCH 64
+
+struct classify {
+	pthread_mutex_t lock;
+	size_t next;
+	char *playable;
+};
+
+/*
+ * Returns the media type of a candidate or NULL if it can't be read.
+ * Lookups which weren't cached are added to calls.
+ */
+static const char *
+classify_file(magic_t mcookie, char *header, struct candidate *candidate,
+    ulong *calls)
+{
+	const char *type;
+
+	if (ctx.cache != NULL) {
+		type = typecache_get(ctx.cache, &candidate->key);
+		if (type != NULL)
+			return type;
+	}
+
+	++*calls;
+	if (header != NULL) {
+		ssize_t len;
+		int fd;
+
+		/* unreadable files are skipped like magic_file does */
+		fd = open(candidate->path, O_RDONLY);
+		if (fd == -1)
+			return NULL;
+
+		len = read(fd, header, ctx.header_size);
+		close(fd);
+		if (len == -1)
+			return NULL;
+
+		type = magic_buffer(mcookie, header, len);
+	} else
+		type = magic_file(mcookie, candidate->path);
+
+	if (type == NULL)
+		die("classify_file: %s", magic_error(mcookie));
 
-	/* if both extension and media-type are set prefer extension search */
-	if (ctx.ext != NULL) {
-		const char *ext;
+	if (ctx.cache != NULL)
+		typecache_put(ctx.cache, &candidate->key, type);
 
-		ext = fpath + strlen(fpath) - strlen(ctx.ext);
-		playable = ext >= fpath && strcasecmp(ext, ctx.ext) == 0;
-	} else if (ctx.type != NULL) {
-		const char *type;
+	return type;
+}
+
+static void *
+classify_files(void *classify_ptr)
+{
+	struct classify *classify = classify_ptr;
+	char *header = NULL;
+	magic_t mcookie;
+	ulong calls = 0;
+
+	/* a magic cookie can't be shared between threads */
+	mcookie = open_magic();
+	if (ctx.header_size > 0)
+		header = xcalloc(1, ctx.header_size);
+
+	for (;;) {
+		size_t i, end;
+
+		pthread_mutex_lock(&classify->lock);
+		i = classify->next;
+		classify->next += CLASSIFY_BATCH;
+		pthread_mutex_unlock(&classify->lock);
+
+		if (i >= ctx.files->size)
+			break;
+
+		end = i + CLASSIFY_BATCH;
+		if (end > ctx.files->size)
+			end = ctx.files->size;
+
+		for (; i < end; ++i) {
+			const char *type;
+
+			type = classify_file(mcookie, header,
+			    ctx.files->items[i], &calls);
+			classify->playable[i] = type != NULL &&
+			    type_matches(type);
+		}
+	}
 
-		type = magic_file(ctx.mcookie, fpath);
-		if (type == NULL)
-			die("collect_files: %s", magic_error(ctx.mcookie));
+	xfree(header);
+	magic_close(mcookie);
+	stats_add(STATS_MAGIC, calls);
 
-		playable = strncmp(ctx.type, type, strlen(ctx.type)) == 0;
+	return NULL;
+}
+
+/*
+ * Where the media types are cached, types found by looking at only
+ * the start of files are kept apart.
+ */
+static char *
+cache_path(void)
+{
+	const char *base;
+	char *path;
+
+	base = getenv("XDG_CACHE_HOME");
+	if (base == NULL || base[0] != '/') {
+		const char *home = getenv("HOME");
+
+		if (home == NULL)
+			return NULL;
+
+		path = xcalloc(1, strlen(home) + 8);
+		sprintf(path, "%s/.cache", home);
 	} else
-		die("Extension or media type is not set.");
+		path = xstrdup(base);
+
+	path = xrealloc(path, strlen(path) + 64);
+	mkdir(path, 0700);
+	strcat(path, "/shuffle");
+	mkdir(path, 0700);
 
-	if (playable)
-		vector_add(ctx.files, xstrdup(fpath));
+	if (ctx.header_size > 0)
+		sprintf(path + strlen(path), "/types.%lu",
+		    (ulong) ctx.header_size);
+	else
+		strcat(path, "/types");
 
-	return 0;
+	return path;
 }
 
 static void
-play_file(void *filename_ptr)
+open_cache(void)
 {
-	char *filename = filename_ptr;
+	char *path;
 
-	switch (fork()) {
-	case -1:
-		die("Can't fork:");
+	if (!ctx.use_cache)
 		return;
-	case 0:
-		if (ctx.verbose)
-			printf("Playing \"%s\".\n", filename);
 
-		ctx.cmd[ctx.pos] = filename;
-		execvp(ctx.cmd[0], (char *const *)ctx.cmd);
-		die("Can't execute player:");
-		break;
-	default:
-		wait(NULL);
-		break;
+	path = cache_path();
+	if (path != NULL)
+		ctx.cache = typecache_open(path);
+	xfree(path);
+}
+
+static void
+close_cache(void)
+{
+	if (ctx.cache != NULL) {
+		typecache_close(ctx.cache);
+		ctx.cache = NULL;
 	}
 }
 
+/*
+ * Run libmagic over the collected files with a thread per cpu and
+ * drop the files which are not of the requested media type. Files
+ * which didn't change since they were cached aren't looked at again.
+ */
 static void
-init_magic(void)
+classify(void)
 {
-	ctx.mcookie = magic_open(MAGIC_MIME);
+	struct classify classify;
+	pthread_t *threads;
+	size_t i, j;
+	int n, nthreads;
 
-	if (ctx.mcookie == NULL)
-		die("Can't open libmagic.");
+	if (ctx.files->size == 0)
+		return;
+
+	open_cache();
+
+	pthread_mutex_init(&classify.lock, NULL);
+	classify.next = 0;
+	classify.playable = xcalloc(ctx.files->size, 1);
+
+	nthreads = cpu_count();
+	threads = xcalloc(nthreads, sizeof(threads[0]));
+	for (n = 0; n < nthreads; ++n)
+		if (pthread_create(&threads[n], NULL, classify_files,
+		    &classify) != 0)
+			die("Can't create classify thread.");
+
+	for (n = 0; n < nthreads; ++n)
+		pthread_join(threads[n], NULL);
+
+	for (i = j = 0; i < ctx.files->size; ++i) {
+		struct candidate *candidate = ctx.files->items[i];
+
+		if (classify.playable[i])
+			ctx.files->items[j++] = candidate->path;
+	}
+	ctx.files->size = j;
+
+	close_cache();
 
-	if (magic_load(ctx.mcookie, NULL) == -1)
-		die("%s.", magic_error(ctx.mcookie));
+	pthread_mutex_destroy(&classify.lock);
+	xfree(classify.playable);
+	xfree(threads);
+}
+
+/*
+ * Start the command for a batch of files. The command is built once
+ * and the files are put in the filename slot, it is started with
+ * posix_spawn so the cost doesn't grow with the memory we hold like
+ * fork's does.
+ */
+static pid_t
+play_file(char **filenames, size_t n)
+{
+	size_t i, suffix;
+	pid_t pid;
+	int error;
+
+	if (ctx.verbose)
+		for (i = 0; i < n; ++i)
+			printf("Playing \"%s\".\n", filenames[i]);
+
+	/* flush so the command's output doesn't get mixed with ours */
+	fflush(stdout);
+
+	if (ctx.pos + n + 1 > ctx.argv_size) {
+		ctx.argv_size = ctx.pos + n + 1 + ctx.cmdlen;
+		ctx.argv = xrealloc(ctx.argv,
+		    ctx.argv_size * sizeof(ctx.argv[0]));
+	}
+
+	suffix = ctx.cmdlen - ctx.pos;
+	memcpy(ctx.argv, ctx.cmd, ctx.pos * sizeof(ctx.argv[0]));
+	memcpy(ctx.argv + ctx.pos, filenames, n * sizeof(ctx.argv[0]));
+	memcpy(ctx.argv + ctx.pos + n, ctx.cmd + ctx.pos + 1,
+	    suffix * sizeof(ctx.argv[0]));
+	ctx.argv[ctx.pos + n + suffix] = NULL;
+
+	error = posix_spawnp(&pid, ctx.argv[0], NULL, NULL,
+	    (char *const *)ctx.argv, environ);
+	if (error != 0) {
+		errno = error;
+		die("Can't execute player:");
+	}
+	STATS_COUNT(STATS_CHILDREN, 1);
+
+	return pid;
+}
+
+/*
+ * The space left for filenames on a command line, leaving some room
+ * for the environment to change in the meantime.
+ */
+static size_t
+arg_space(void)
+{
+	long max = -1;
+	size_t used = 2048;
+	int i;
+
+#ifdef _SC_ARG_MAX
+	max = sysconf(_SC_ARG_MAX);
+#endif
+	if (max <= 0)
+		max = _POSIX_ARG_MAX;
+
+	for (i = 0; environ[i] != NULL; ++i)
+		used += strlen(environ[i]) + 1 + sizeof(char *);
+
+	for (i = 0; i < ctx.cmdlen + 1; ++i)
+		if (i != ctx.pos)
+			used += strlen(ctx.cmd[i]) + 1 + sizeof(char *);
+
+	return (size_t)max > used ? (size_t)max - used : 0;
+}
+
+/*
+ * The next file to play or NULL if there are none left. While the
+ * walk is running this waits until enough files have been found to
+ * pick one from, candidates left to classify are classified here.
+ */
+static char *
+next_file(void)
+{
+	struct candidate *candidate;
+	const char *type;
+	ulong calls;
+
+	if (!ctx.stream)
+		return ctx.next < ctx.files->size ?
+		    ctx.files->items[ctx.next++] : NULL;
+
+	for (;;) {
+		pthread_mutex_lock(&ctx.lock);
+		while (!ctx.walk_done &&
+		    (ctx.files->size == 0 || ctx.files->size < ctx.window))
+			pthread_cond_wait(&ctx.found, &ctx.lock);
+		candidate = ctx.files->size > 0 ?
+		    vector_take_random(ctx.files) : NULL;
+		pthread_mutex_unlock(&ctx.lock);
+
+		if (candidate == NULL || ctx.type == NULL)
+			return (char *)candidate;
+
+		if (ctx.mcookie == NULL) {
+			ctx.mcookie = open_magic();
+			if (ctx.header_size > 0)
+				ctx.header = xcalloc(1, ctx.header_size);
+		}
+
+		calls = 0;
+		type = classify_file(ctx.mcookie, ctx.header, candidate,
+		    &calls);
+		STATS_COUNT(STATS_MAGIC, calls);
+		if (type != NULL && type_matches(type))
+			return candidate->path;
+	}
+}
+
+/*
+ * Wait for a command to finish, returns FALSE if it failed.
+ */
+static int
+reap(void)
+{
+	int status;
+
+	while (waitpid(-1, &status, 0) == -1)
+		if (errno != EINTR)
+			die("Can't wait for child:");
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * Run the command for every file, or batch of files, in order keeping
+ * up to ctx.jobs of them running. Returns the number of commands which
+ * failed.
+ */
+static size_t
+play_files(void)
+{
+	size_t failed = 0, running = 0, commands = 0, space, used;
+	struct vector *batch;
+	char *held = NULL;
+
+	batch = vector_new();
+	space = arg_space();
+	for (;;) {
+		if (ctx.stop_on_failure && failed > 0)
+			break;
+
+		if (running == (size_t)ctx.jobs) {
+			if (!reap())
+				++failed;
+			--running;
+
+			if (ctx.stop_on_failure && failed > 0)
+				break;
+		}
+
+		/* take as many files as fit on one command line */
+		batch->size = used = 0;
+		while (batch->size < ctx.batch) {
+			char *file = held != NULL ? held : next_file();
+
+			held = NULL;
+			if (file == NULL)
+				break;
+
+			/* always take at least one, it is the command's problem */
+			used += strlen(file) + 1 + sizeof(char *);
+			if (batch->size > 0 && used > space) {
+				held = file;
+				break;
+			}
+
+			vector_add(batch, file);
+		}
+
+		if (batch->size == 0)
+			break;
+
+		play_file((char **)batch->items, batch->size);
+		ctx.played += batch->size;
+		++commands;
+		++running;
+	}
+
+	for (; running > 0; --running)
+		if (!reap())
+			++failed;
+
+	if (ctx.verbose && ctx.stream)
+		printf("%lu commands run for %lu files, %lu failed.\n",
+		    (ulong) commands, (ulong) ctx.played, (ulong) failed);
+	else if (ctx.verbose)
+		printf("%lu commands run for %lu of %lu files, %lu failed.\n",
+		    (ulong) commands, (ulong) ctx.played,
+		    (ulong) ctx.files->size, (ulong) failed);
+
+	vector_free(batch);
+
+	return failed;
+}
+
+struct stream {
+	struct walk *walker;
+	char *path;
+};
+
+static void *
+stream_files(void *stream_ptr)
+{
+	struct stream *stream = stream_ptr;
+	struct vector *unused;
+
+	/* the files go to ctx.files right away */
+	unused = vector_new();
+	walk_indexed(stream->walker, &stream->path, 1, unused, ctx.arena,
+	    ctx.index_path);
+	vector_free(unused);
+
+	pthread_mutex_lock(&ctx.lock);
+	ctx.walk_done = TRUE;
+	pthread_cond_broadcast(&ctx.found);
+	pthread_mutex_unlock(&ctx.lock);
+
+	return NULL;
+}
+
+/*
+ * Walk in the background and start playing as soon as enough files
+ * have been found. Returns the number of commands which failed.
+ */
+static size_t
+play_streaming(struct walk *walker, char *path)
+{
+	struct stream stream;
+	pthread_t thread;
+	size_t failed;
+
+	if (ctx.type != NULL)
+		open_cache();
+
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.found, NULL);
+
+	stream.walker = walker;
+	stream.path = path;
+	if (pthread_create(&thread, NULL, stream_files, &stream) != 0)
+		die("Can't create walk thread.");
+
+	failed = play_files();
+
+	/* let the walk finish so its index is written */
+	pthread_join(thread, NULL);
+
+	pthread_cond_destroy(&ctx.found);
+	pthread_mutex_destroy(&ctx.lock);
+
+	close_cache();
+	if (ctx.mcookie != NULL)
+		magic_close(ctx.mcookie);
+	xfree(ctx.header);
+
+	return failed;
 }
 
 /*
@@ -163,21 +707,62 @@ build_command(int argc, char **argv, int start)
 	/* If no % found append filename. */
 	if (ctx.pos == -1)
 		ctx.pos = cmdlen;
+	else
+		--cmdlen;
+
+	/* the number of arguments without the filename */
+	ctx.cmdlen = cmdlen;
+}
+
+static int
+by_path(const void *path_a, const void *path_b)
+{
+	STATS_COUNT(STATS_COMPARES, 1);
+	return strcmp(*(char *const *)path_a, *(char *const *)path_b);
+}
+
+/*
+ * Add a comma separated list of extensions, which can be patterns
+ * themselves like mp?, as patterns for the end of the name.
+ */
+static void
+add_extensions(const char *list)
+{
+	char *copy, *ext, *pattern;
+
+	copy = xstrdup(list);
+	for (ext = strtok(copy, ","); ext != NULL; ext = strtok(NULL, ",")) {
+		pattern = xcalloc(1, strlen(ext) + 3);
+		sprintf(pattern, "*%s%s", ext[0] != '.' ? "." : "", ext);
+		filter_add_name(&ctx.filter, pattern);
+		xfree(pattern);
+	}
+	xfree(copy);
 }
 
 static void
 usage(void)
 {
-	fprintf(stderr, "%s", usage_string);
+	size_t i;
+
+	for (i = 0; i < sizeof(usage_string) / sizeof(usage_string[0]); ++i)
+		fprintf(stderr, "%s", usage_string[i]);
 	exit(EXIT_FAILURE);
 }
 
 int
 main(int argc, char **argv)
 {
-	char *path = NULL;
+	char *path = NULL, *end;
+	struct walk walker;
+	size_t failed;
 	int opt;
 
+	ctx.use_cache = TRUE;
+	ctx.jobs = 1;
+	filter_init(&ctx.filter);
+	ctx.batch = 1;
+
 	/*
 	 * GNU libc is not posix compliant and needs a + to stop
 	 * getopt from parsing options after the last one otherwise
@@ -185,26 +770,58 @@ main(int argc, char **argv)
 	 * could stop that by prefixing the command with --).
 	 */
 #ifdef __GNU_LIBRARY__
-	while ((opt = getopt(argc, argv, "+e:p:t:v")) != -1) {
+	while ((opt = getopt(argc, argv, "+b:Ce:i:j:M:n:N:p:s:S:t:TvxZ:")) != -1) {
 #else
-	while ((opt = getopt(argc, argv, "e:p:t:v")) != -1) {
+	while ((opt = getopt(argc, argv, "b:Ce:i:j:M:n:N:p:s:S:t:TvxZ:")) != -1) {
 #endif
 		switch (opt) {
+		case 'b':
+			ctx.header_size = string_to_number(optarg);
+			break;
+		case 'C':
+			ctx.use_cache = FALSE;
+			break;
+		case 'i':
+			ctx.index_path = optarg;
+			break;
+		case 'j':
+			ctx.jobs = atoi(optarg);
+			if (ctx.jobs < 1)
+				usage();
+			break;
+		case 'n':
+			if (atoi(optarg) < 0)
+				usage();
+			ctx.batch = atoi(optarg) == 0 ? (size_t)-1 :
+			    (size_t)atoi(optarg);
+			break;
 		case 'e':
-			ctx.ext = xstrdup(optarg);
-			if (ctx.ext[0] != '.') {
-				char *p;
-
-				p = xcalloc(1, strlen(ctx.ext) + 2);
-				sprintf(p, ".%s", ctx.ext);
-				free(ctx.ext);
-				ctx.ext = p;
-			}
+			add_extensions(optarg);
+			break;
+		case 'M':
+		case 'N':
+		case 'Z':
+			if (!filter_option(&ctx.filter, opt, optarg))
+				usage();
+			break;
+		case 's':
+			if (atoi(optarg) < 0)
+				usage();
+			ctx.stream = TRUE;
+			ctx.window = atoi(optarg);
+			break;
+		case 'S':
+			vector_seed(strtoul(optarg, &end, 0));
+			if (*optarg == '\0' || *end != '\0')
+				usage();
+			ctx.seeded = TRUE;
 			break;
 		case 't':
-			init_magic();
 			ctx.type = optarg;
 			break;
+		case 'T':
+			stats_start();
+			break;
 		case 'p':
 			path = realpath(optarg, NULL);
 			if (path == NULL)
@@ -213,20 +830,26 @@ main(int argc, char **argv)
 		case 'v':
 			ctx.verbose = TRUE;
 			break;
+		case 'x':
+			ctx.stop_on_failure = TRUE;
+			break;
 		}
 	}
 
-	/* extension or type must be set */
-	if (ctx.ext == NULL && ctx.type == NULL)
+	/* a filter or type must be set */
+	if (ctx.filter.nstages == 0 && ctx.type == NULL)
 		usage();
 
+	if (ctx.type != NULL)
+		filter_add(&ctx.filter, may_match_type, NULL, FILTER_STAT);
+
 	/* a command to run is mandatory */
 	if (optind >= argc)
 		usage();
 
 	build_command(argc, argv, optind);
 
-	if (ctx.verbose) {
+	if (ctx.verbose && !ctx.stream) {
 		printf("Searching for files...");
 		fflush(stdout);
 	}
@@ -236,32 +859,65 @@ main(int argc, char **argv)
 	if (path == NULL)
 		path = xstrdup(".");
 
-	if (nftw(path, collect_files, MAXFD, FTW_PHYS) == -1)
-		die("nftw:");
+	walker.fn = collect_files;
+	walker.flags = WALK_PHYS | ctx.filter.flags |
+	    (ctx.type != NULL ? WALK_STAT : 0);
+	walker.maxlevel = -1;
+	walker.nthreads = 0;
+	walker.dirs = NULL;
+	walker.index = NULL;
+	walker.records = NULL;
+
+	ctx.arena = arena_new();
+	if (ctx.stream) {
+		stats_phase("stream");
+		failed = play_streaming(&walker, path);
+		free(path);
+
+		if (ctx.played == 0) {
+			if (ctx.verbose)
+				printf("No files found.\n");
+
+			exit(1);
+		}
+	} else {
+		stats_phase("walk");
+		walk_indexed(&walker, &path, 1, ctx.files, ctx.arena,
+		    ctx.index_path);
+		free(path);
+
+		if (ctx.type != NULL) {
+			stats_phase("classify");
+			classify();
+		}
 
-	free(path);
+		if (ctx.files->size == 0) {
+			if (ctx.verbose)
+				printf("no files found.\n");
 
-	if (ctx.mcookie != NULL)
-		magic_close(ctx.mcookie);
+			exit(1);
+		}
 
-	if (ctx.files->size == 0) {
 		if (ctx.verbose)
-			printf("no files found.\n");
+			printf("%lu files found.\n", (ulong) ctx.files->size);
 
-		exit(1);
-	}
+		/* the walk finds files in no particular order */
+		stats_phase("shuffle");
+		if (ctx.seeded)
+			qsort(ctx.files->items, ctx.files->size,
+			    sizeof(ctx.files->items[0]), by_path);
 
-	if (ctx.verbose)
-		printf("%lu files found.\n", (ulong) ctx.files->size);
+		vector_shuffle(ctx.files);
 
-	vector_shuffle(ctx.files);
-	vector_foreach(ctx.files, play_file);
+		stats_phase("play");
+		failed = play_files();
+	}
 
 	xfree(ctx.cmd);
-	vector_foreach(ctx.files, free);
+	xfree(ctx.argv);
 	vector_free(ctx.files);
-	if (ctx.ext != NULL)
-		xfree(ctx.ext);
+	arena_free(ctx.arena);
+	filter_free(&ctx.filter);
 
-	return EXIT_SUCCESS;
+	return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
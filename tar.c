@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#define _XOPEN_SOURCE 600
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tar.h"
+#include "utils.h"
+
+/* the largest values the octal fields of a ustar header can hold */
+#define TAR_MAX_SIZE 077777777777UL
+#define TAR_MAX_ID 07777777UL
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+struct tar *
+tar_open(const char *path)
+{
+	struct tar *tar;
+	void *buf;
+
+	tar = xcalloc(1, sizeof(*tar));
+	tar->path = xstrdup(path);
+	tar->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (tar->fd == -1)
+		die("Can't create '%s':", path);
+
+	/* aligned so the kernel can hand it to the device as is */
+	if (posix_memalign(&buf, TAR_BLOCK, TAR_BUFSIZE) != 0)
+		die("posix_memalign:");
+	tar->buf = buf;
+
+	return tar;
+}
+
+static void
+tar_flush(struct tar *tar)
+{
+	size_t done = 0;
+
+	while (done < tar->len) {
+		ssize_t n = write(tar->fd, tar->buf + done, tar->len - done);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			die("Can't write '%s':", tar->path);
+		}
+		done += n;
+	}
+
+	tar->len = 0;
+}
+
+static void
+tar_write(struct tar *tar, const void *data, size_t len)
+{
+	const char *p = data;
+
+	while (len > 0) {
+		size_t n = TAR_BUFSIZE - tar->len;
+
+		if (n > len)
+			n = len;
+		memcpy(tar->buf + tar->len, p, n);
+		tar->len += n;
+		tar->size += n;
+		p += n;
+		len -= n;
+
+		if (tar->len == TAR_BUFSIZE)
+			tar_flush(tar);
+	}
+}
+
+/* pad the archive with zeroes to a multiple of size */
+static void
+tar_pad(struct tar *tar, off_t written, size_t size)
+{
+	static const char zeroes[TAR_BLOCK];
+	size_t n = written == 0 ? size : (size - written % size) % size;
+
+	while (n > 0) {
+		size_t len = n < sizeof(zeroes) ? n : sizeof(zeroes);
+
+		tar_write(tar, zeroes, len);
+		n -= len;
+	}
+}
+
+/* the values are checked to fit, the field ends in a NUL */
+static void
+octal(char *field, size_t size, ulong value)
+{
+	char buf[32];
+
+	sprintf(buf, "%0*lo", (int)size - 1, value);
+	memcpy(field, buf, size - 1);
+}
+
+/* append a "length key=value\n" record, the length counts itself */
+static void
+pax_record(char **records, size_t *len, const char *key, const char *value)
+{
+	size_t n, digits = 1, size = strlen(key) + strlen(value) + 3;
+
+	for (;;) {
+		size_t need = 1;
+
+		for (n = size + digits; n >= 10; n /= 10)
+			++need;
+		if (need == digits)
+			break;
+		digits = need;
+	}
+	size += digits;
+
+	*records = xrealloc(*records, *len + size + 1);
+	sprintf(*records + *len, "%lu %s=%s\n", (ulong) size, key, value);
+	*len += size;
+}
+
+/*
+ * Split name in a prefix and a name at a slash if it is too long for
+ * the name field. Returns FALSE if it can't be split.
+ */
+static int
+split_name(struct tar_header *header, const char *name)
+{
+	size_t len = strlen(name), i;
+
+	if (len <= sizeof(header->name)) {
+		memcpy(header->name, name, len);
+		return TRUE;
+	}
+
+	for (i = len - 1; i > 0; --i) {
+		if (name[i] != '/')
+			continue;
+		if (len - i - 1 > sizeof(header->name))
+			break;
+		if (i <= sizeof(header->prefix) && len - i - 1 > 0) {
+			memcpy(header->prefix, name, i);
+			memcpy(header->name, name + i + 1, len - i - 1);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void
+write_header(struct tar *tar, const char *name, const struct stat *st,
+    char type, off_t size)
+{
+	struct tar_header header;
+	const unsigned char *p;
+	size_t i, recordslen = 0;
+	char *records = NULL, value[32];
+	ulong sum;
+
+	memset(&header, 0, sizeof(header));
+	if (!split_name(&header, name)) {
+		pax_record(&records, &recordslen, "path", name);
+		memcpy(header.name, name, sizeof(header.name));
+	}
+
+	if ((ulong)size > TAR_MAX_SIZE || size != (off_t)(ulong)size) {
+		sprintf(value, "%.0f", (double)size);
+		pax_record(&records, &recordslen, "size", value);
+	} else
+		octal(header.size, sizeof(header.size), size);
+
+	if ((ulong)st->st_uid > TAR_MAX_ID) {
+		sprintf(value, "%lu", (ulong) st->st_uid);
+		pax_record(&records, &recordslen, "uid", value);
+	} else
+		octal(header.uid, sizeof(header.uid), st->st_uid);
+
+	if ((ulong)st->st_gid > TAR_MAX_ID) {
+		sprintf(value, "%lu", (ulong) st->st_gid);
+		pax_record(&records, &recordslen, "gid", value);
+	} else
+		octal(header.gid, sizeof(header.gid), st->st_gid);
+
+	if (records != NULL) {
+		struct stat pax_st = *st;
+
+		pax_st.st_uid = pax_st.st_gid = 0;
+		write_header(tar, "././@PaxHeader", &pax_st, 'x', recordslen);
+		tar_write(tar, records, recordslen);
+		tar_pad(tar, recordslen, TAR_BLOCK);
+		xfree(records);
+	}
+
+	octal(header.mode, sizeof(header.mode), st->st_mode & 07777);
+	octal(header.mtime, sizeof(header.mtime),
+	    st->st_mtime > 0 ? (ulong)st->st_mtime : 0);
+	header.typeflag = type;
+	memcpy(header.magic, "ustar", sizeof(header.magic));
+	memcpy(header.version, "00", sizeof(header.version));
+
+	/* the checksum is taken with the field set to spaces */
+	memset(header.chksum, ' ', sizeof(header.chksum));
+	p = (const unsigned char *)&header;
+	for (sum = 0, i = 0; i < sizeof(header); ++i)
+		sum += p[i];
+	sprintf(header.chksum, "%06lo", sum);
+
+	tar_write(tar, &header, sizeof(header));
+}
+
+void
+tar_add_dir(struct tar *tar, const char *name, const struct stat *st)
+{
+	char *dirname;
+
+	/* directories are marked with a trailing slash */
+	dirname = xcalloc(1, strlen(name) + 2);
+	sprintf(dirname, "%s/", name);
+	write_header(tar, dirname, st, '5', 0);
+	xfree(dirname);
+}
+
+/*
+ * Add the open file fd to the archive as name. The data is read
+ * straight into the archive buffer and dropped from the page cache
+ * once it is written, it is only read once.
+ */
+void
+tar_add_file(struct tar *tar, int fd, const char *name,
+    const struct stat *st)
+{
+	off_t left = st->st_size;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	write_header(tar, name, st, '0', st->st_size);
+
+	while (left > 0) {
+		size_t room = TAR_BUFSIZE - tar->len;
+		ssize_t n;
+
+		if ((off_t)room > left)
+			room = left;
+
+		n = read(fd, tar->buf + tar->len, room);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			die("Can't read '%s':", name);
+		}
+		if (n == 0)
+			die("'%s' got shorter while archiving it.", name);
+
+		tar->len += n;
+		tar->size += n;
+		left -= n;
+		if (tar->len == TAR_BUFSIZE)
+			tar_flush(tar);
+	}
+	tar_pad(tar, st->st_size, TAR_BLOCK);
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/* end the archive with two zero blocks and pad it to a whole record */
+void
+tar_close(struct tar *tar)
+{
+	tar_pad(tar, 0, 2 * TAR_BLOCK);
+	tar_pad(tar, tar->size, TAR_RECORD);
+	tar_flush(tar);
+
+	if (close(tar->fd) == -1)
+		die("Can't write '%s':", tar->path);
+
+	free(tar->buf);
+	xfree(tar->path);
+	xfree(tar);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef TAR_H
+#define TAR_H
+
+#include <sys/types.h>
+
+/*
+ * A tar archive written as a stream. Members are ustar headers with
+ * pax extended headers for what doesn't fit in them, the data goes
+ * through one large aligned buffer.
+ */
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK)
+#define TAR_BUFSIZE (1024 * 1024)
+
+struct stat;
+
+struct tar {
+	char *path;
+	char *buf;
+	size_t len;			/* bytes in the buffer */
+	off_t size;			/* bytes written so far */
+	int fd;
+};
+
+struct tar *tar_open(const char *);
+void tar_add_dir(struct tar *, const char *, const struct stat *);
+void tar_add_file(struct tar *, int, const char *, const struct stat *);
+void tar_close(struct tar *);
+
+#endif
@@ -0,0 +1,138 @@
+#!/bin/sh
+#
+# Regression tests of the tools on small trees made in a scratch
+# directory. Every test prints a line with ok or FAIL and its name, the
+# script exits with an error if any of them failed.
+#
+# TEST_DIR is where the trees are made.
+
+dir=${TEST_DIR:-/tmp/tools-test}
+here=$(cd "$(dirname "$0")" && pwd)
+failed=0
+
+# check name command..., passes if the command succeeds
+check() {
+	name=$1
+	shift
+	if "$@" >"$dir/out" 2>"$dir/err"; then
+		echo "ok	$name"
+	else
+		echo "FAIL	$name"
+		sed 's/^/	/' "$dir/err"
+		failed=1
+	fi
+}
+
+rm -rf "$dir"
+mkdir -p "$dir"
+cd "$dir" || exit 1
+
+# a symbolic link back up is only followed once
+mkdir -p loop/a
+echo data >loop/a/file
+ln -s .. loop/a/up
+check "fit follows a symlink loop once" sh -c "
+	'$here/fit' -r -s 1m loop >out.txt &&
+	grep -q 'loop/a/file' out.txt &&
+	test \$(grep -c 'file' out.txt) -eq 1"
+
+# a directory reached through two links is listed by the smallest path
+mkdir -p two/real/dir two/b two/z/x/y
+echo data >two/real/dir/file
+ln -s ../real/dir two/b/link
+ln -s ../../../real/dir two/z/x/y/a
+check "fit lists a directory by its smallest path" sh -c "
+	'$here/fit' -r -s 1m -p csv two >two.csv &&
+	test \$(grep -c '/file\$' two.csv) -eq 1 &&
+	grep -q ',two/b/link/file\$' two.csv &&
+	'$here/fit' -L 1m -r -s 1m -p csv two >spilled.csv &&
+	cmp two.csv spilled.csv"
+
+# files replayed from an index take up the same blocks as when read
+mkdir blocks
+for i in 1 2 3; do
+	dd if=/dev/zero of=blocks/file$i bs=1000 count=300 2>/dev/null
+done
+check "fit -b 0 is the same from an index" sh -c "
+	'$here/fit' -i blocks.idx -r -b 0 -s 1m blocks >walked.txt &&
+	'$here/fit' -i blocks.idx -r -b 0 -s 1m blocks >indexed.txt &&
+	cmp walked.txt indexed.txt"
+
+# messages don't end up in a manifest, -e reads it back
+check "fit -o keeps a json manifest clean" sh -c "
+	'$here/fit' -o 1 -r -s 1m -p json blocks >opt.json &&
+	'$here/fit' -r -s 1m -p json -e opt.json blocks >again.json &&
+	test ! -s again.json"
+
+check "fit -v -l keeps a csv manifest clean" sh -c "
+	ln blocks/file1 blocks/link && mkdir -m 700 disks &&
+	'$here/fit' -v -l disks -r -s 1m -p csv blocks >linked.csv &&
+	'$here/fit' -r -s 1m -p csv -e linked.csv blocks >again.csv &&
+	test ! -s again.csv"
+
+# a csv manifest extended twice by appending to it
+mkdir -p grow/a grow/b grow/c
+for d in a b c; do
+	dd if=/dev/zero of=grow/$d/file bs=1000 count=400 2>/dev/null
+done
+check "fit -e extends a csv manifest twice" sh -c "
+	'$here/fit' -v -r -s 1m -p csv grow/a >grow.csv &&
+	'$here/fit' -v -r -s 1m -p csv -e grow.csv grow/a grow/b >>grow.csv &&
+	'$here/fit' -v -r -s 1m -p csv -e grow.csv grow/a grow/b grow/c \
+	    >>grow.csv &&
+	test \$(grep -c '^disk,' grow.csv) -eq 1 &&
+	test \$(grep -c '/file\$' grow.csv) -eq 3 &&
+	grep -q '^2,400000,grow/c/file\$' grow.csv &&
+	'$here/fit' -v -r -s 1m -p csv -e grow.csv grow >again.csv &&
+	test ! -s again.csv"
+
+check "fit -l uses a disk directory which is there already" sh -c "
+	mkdir -m 700 again again/0001 &&
+	'$here/fit' -r -s 1m -l again blocks &&
+	test -f again/0001/blocks/file1"
+
+# names which sort between a directory and its subdirectories
+mkdir -p tree/a/b/c tree/a/b-c tree/a-c/x
+for d in tree/a tree/a/b tree/a/b/c tree/a/b-c tree/a-c/x; do
+	echo data >$d/file
+done
+check "fit -m tar archives every directory once" sh -c "
+	mkdir -m 700 tars &&
+	'$here/fit' -r -s 1m -l tars -m tar tree &&
+	tar tf tars/0001.tar | sort | uniq -d >dups.txt &&
+	test ! -s dups.txt &&
+	test \$(tar tf tars/0001.tar | grep -c '/file\$') -eq 5"
+
+# mvd doesn't move a file over another one
+mkdir -p same/a same/b moved/202401
+echo a >same/a/file
+echo b >same/b/file
+echo old >moved/202401/old
+cp same/a/file same/old
+touch -t 202401050000 same/a/file same/b/file same/old
+check "mvd refuses two files with the same name" sh -c "
+	! '$here/mvd' same/a/file same/b/file moved 2>/dev/null &&
+	test -f same/a/file && test -f same/b/file"
+check "mvd doesn't replace a file in a bucket" sh -c "
+	! '$here/mvd' same/old moved 2>/dev/null &&
+	test -f same/old && grep -q old moved/202401/old"
+
+# a link moved to another filesystem stays a link
+other=${TEST_OTHER_FS:-/dev/shm}
+if [ -d "$other" ] && [ "$(stat -c %d "$other")" != "$(stat -c %d .)" ]; then
+	rm -rf "$other/tools-test"
+	mkdir -p links "$other/tools-test"
+	echo data >links/file
+	ln -s file links/link
+	check "mvd copies a link to another filesystem as a link" sh -c "
+		'$here/mvd' links/link links/file '$other/tools-test' &&
+		test -h '$other/tools-test'/*/link &&
+		test ! -h '$other/tools-test'/*/file &&
+		test ! -e links/link"
+	rm -rf "$other/tools-test"
+else
+	echo "skip	mvd copies a link to another filesystem as a link"
+fi
+
+cd / && rm -rf "$dir"
+exit $failed
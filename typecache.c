@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _XOPEN_SOURCE 600
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "typecache.h"
+#include "vector.h"
+#include "utils.h"
+
+/* merge the log into the cache file when it's more than a quarter */
+#define MAX_LOG_RATIO 4
+
+/* longer types mean the log is damaged */
+#define MAX_TYPE_LENGTH 1024
+
+static int
+compare_ids(const struct typecache_key *a, const struct typecache_key *b)
+{
+	if (a->dev != b->dev)
+		return a->dev < b->dev ? -1 : 1;
+	if (a->ino != b->ino)
+		return a->ino < b->ino ? -1 : 1;
+
+	return 0;
+}
+
+static int
+same_version(const struct typecache_key *a, const struct typecache_key *b)
+{
+	return a->mtime == b->mtime && a->size == b->size;
+}
+
+/* sort by id, the latest entry for an id first */
+static int
+by_id_latest_first(const void *entry_a, const void *entry_b)
+{
+	const struct typecache_entry *a = entry_a;
+	const struct typecache_entry *b = entry_b;
+	int cmp;
+
+	cmp = compare_ids(&a->key, &b->key);
+	if (cmp != 0)
+		return cmp;
+
+	return a->seq < b->seq ? 1 : a->seq > b->seq ? -1 : 0;
+}
+
+static void
+map_cache(struct typecache *cache)
+{
+	const struct typecache_header *header;
+	struct stat st;
+	size_t records_size;
+	int fd;
+
+	fd = open(cache->path, O_RDONLY);
+	if (fd == -1)
+		return;
+
+	if (fstat(fd, &st) == -1 ||
+	    (size_t)st.st_size < sizeof(struct typecache_header)) {
+		close(fd);
+		return;
+	}
+
+	cache->mapsize = st.st_size;
+	cache->map = mmap(NULL, cache->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (cache->map == MAP_FAILED) {
+		cache->map = NULL;
+		return;
+	}
+
+	/* a cache which doesn't add up is ignored and rewritten later */
+	header = cache->map;
+	records_size = cache->mapsize - sizeof(*header);
+	if (memcmp(header->magic, TYPECACHE_MAGIC, sizeof(header->magic)) ||
+	    header->count > records_size / sizeof(struct typecache_record) ||
+	    header->count * sizeof(struct typecache_record) + header->strsize !=
+	    records_size) {
+		munmap(cache->map, cache->mapsize);
+		cache->map = NULL;
+		return;
+	}
+
+	cache->records = (const struct typecache_record *)(header + 1);
+	cache->count = header->count;
+	cache->strings = (const char *)(cache->records + cache->count);
+	cache->strsize = header->strsize;
+}
+
+static void
+read_log(struct typecache *cache)
+{
+	struct typecache_record record;
+	size_t capacity = 0;
+	FILE *fp;
+
+	fp = fopen(cache->logpath, "rb");
+	if (fp == NULL)
+		return;
+
+	while (fread(&record, sizeof(record), 1, fp) == 1) {
+		struct typecache_entry *entry;
+		char *type;
+
+		if (record.type > MAX_TYPE_LENGTH)
+			break;
+
+		type = arena_alloc(cache->arena, record.type + 1);
+		if (fread(type, 1, record.type, fp) != record.type)
+			break;
+		type[record.type] = '\0';
+
+		if (cache->logcount == capacity) {
+			capacity = capacity == 0 ? 128 : capacity + (capacity >> 1);
+			cache->log = xrealloc(cache->log,
+			    capacity * sizeof(cache->log[0]));
+		}
+
+		entry = &cache->log[cache->logcount];
+		entry->key = record.key;
+		entry->type = type;
+		entry->seq = ++cache->logcount;
+	}
+
+	fclose(fp);
+
+	qsort(cache->log, cache->logcount, sizeof(cache->log[0]),
+	    by_id_latest_first);
+}
+
+/*
+ * Open the cache at path, a missing or damaged cache is the same as
+ * an empty one.
+ */
+struct typecache *
+typecache_open(const char *path)
+{
+	struct typecache *cache;
+
+	cache = xcalloc(1, sizeof(*cache));
+	cache->path = xstrdup(path);
+	cache->logpath = xcalloc(1, strlen(path) + 5);
+	sprintf(cache->logpath, "%s.log", path);
+
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->added = vector_new();
+	cache->arena = arena_new();
+
+	map_cache(cache);
+	read_log(cache);
+
+	return cache;
+}
+
+/*
+ * Look up the type of a file, returns NULL if the file isn't in the
+ * cache or changed since. This can be used by several threads as
+ * long as no one closes the cache.
+ */
+const char *
+typecache_get(const struct typecache *cache, const struct typecache_key *key)
+{
+	size_t lo, hi;
+
+	/* the log is newer so look there first */
+	lo = 0;
+	hi = cache->logcount;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (compare_ids(&cache->log[mid].key, key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < cache->logcount &&
+	    compare_ids(&cache->log[lo].key, key) == 0 &&
+	    same_version(&cache->log[lo].key, key))
+		return cache->log[lo].type;
+
+	lo = 0;
+	hi = cache->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = compare_ids(&cache->records[mid].key, key);
+
+		if (cmp == 0) {
+			const struct typecache_record *record;
+
+			record = &cache->records[mid];
+			if (!same_version(&record->key, key) ||
+			    record->type >= cache->strsize)
+				return NULL;
+
+			return cache->strings + record->type;
+		}
+
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+/*
+ * Remember the type of a file, it is saved when the cache is closed.
+ */
+void
+typecache_put(struct typecache *cache, const struct typecache_key *key,
+    const char *type)
+{
+	struct typecache_entry *entry;
+
+	pthread_mutex_lock(&cache->lock);
+	entry = arena_alloc(cache->arena, sizeof(*entry));
+	entry->key = *key;
+	entry->type = arena_strdup(cache->arena, type);
+	entry->seq = cache->logcount + cache->added->size + 1;
+	vector_add(cache->added, entry);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static int
+append_log(struct typecache *cache)
+{
+	size_t i;
+	FILE *fp;
+	int ok = TRUE;
+
+	fp = fopen(cache->logpath, "ab");
+	if (fp == NULL)
+		return FALSE;
+
+	for (i = 0; i < cache->added->size && ok; ++i) {
+		struct typecache_entry *entry = cache->added->items[i];
+		struct typecache_record record;
+
+		memset(&record, 0, sizeof(record));
+		record.key = entry->key;
+		record.type = strlen(entry->type);
+
+		ok = fwrite(&record, sizeof(record), 1, fp) == 1 &&
+		    fwrite(entry->type, 1, record.type, fp) == record.type;
+	}
+
+	return fclose(fp) == 0 && ok;
+}
+
+static int
+by_type(const void *entry_a, const void *entry_b)
+{
+	const struct typecache_entry *a, *b;
+
+	a = *(const struct typecache_entry *const *)entry_a;
+	b = *(const struct typecache_entry *const *)entry_b;
+
+	return strcmp(a->type, b->type);
+}
+
+/*
+ * Write the cache file, log and new entries into a new cache file
+ * keeping only the latest entry for every file.
+ */
+static int
+compact(struct typecache *cache)
+{
+	struct typecache_entry *entries, **types;
+	struct typecache_header header;
+	char *distinct;
+	size_t i, n, count, strsize;
+	char *tmppath;
+	FILE *fp;
+	int ok;
+
+	n = cache->count + cache->logcount + cache->added->size;
+	entries = xcalloc(n + 1, sizeof(entries[0]));
+
+	for (i = 0; i < cache->count; ++i) {
+		const struct typecache_record *record = &cache->records[i];
+
+		if (record->type >= cache->strsize)
+			continue;
+
+		entries[i].key = record->key;
+		entries[i].type = cache->strings + record->type;
+		entries[i].seq = 0;
+	}
+	memcpy(entries + cache->count, cache->log,
+	    cache->logcount * sizeof(entries[0]));
+	for (i = 0; i < cache->added->size; ++i) {
+		struct typecache_entry *entry = cache->added->items[i];
+
+		entries[cache->count + cache->logcount + i] = *entry;
+	}
+
+	/* drop unusable and superseded entries */
+	qsort(entries, n, sizeof(entries[0]), by_id_latest_first);
+	for (i = count = 0; i < n; ++i) {
+		if (entries[i].type == NULL)
+			continue;
+		if (count > 0 &&
+		    compare_ids(&entries[count - 1].key, &entries[i].key) == 0)
+			continue;
+
+		entries[count++] = entries[i];
+	}
+
+	/* every distinct type is stored once, seq now holds its offset */
+	types = xcalloc(count + 1, sizeof(types[0]));
+	for (i = 0; i < count; ++i)
+		types[i] = &entries[i];
+	qsort(types, count, sizeof(types[0]), by_type);
+
+	strsize = 0;
+	distinct = xcalloc(count + 1, 1);
+	for (i = 0; i < count; ++i) {
+		if (i > 0 && strcmp(types[i - 1]->type, types[i]->type) == 0) {
+			types[i]->seq = types[i - 1]->seq;
+			continue;
+		}
+
+		types[i]->seq = strsize;
+		distinct[i] = TRUE;
+		strsize += strlen(types[i]->type) + 1;
+	}
+
+	tmppath = xcalloc(1, strlen(cache->path) + 32);
+	sprintf(tmppath, "%s.%lu.tmp", cache->path, (ulong) getpid());
+
+	fp = fopen(tmppath, "wb");
+	ok = fp != NULL;
+
+	if (ok) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, TYPECACHE_MAGIC, sizeof(header.magic));
+		header.count = count;
+		header.strsize = strsize;
+		ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+	}
+
+	for (i = 0; i < count && ok; ++i) {
+		struct typecache_record record;
+
+		memset(&record, 0, sizeof(record));
+		record.key = entries[i].key;
+		record.type = entries[i].seq;
+		ok = fwrite(&record, sizeof(record), 1, fp) == 1;
+	}
+
+	for (i = 0; i < count && ok; ++i) {
+		size_t len = strlen(types[i]->type) + 1;
+
+		if (distinct[i])
+			ok = fwrite(types[i]->type, 1, len, fp) == len;
+	}
+
+	if (fp != NULL && fclose(fp) != 0)
+		ok = FALSE;
+
+	if (ok && rename(tmppath, cache->path) == 0)
+		unlink(cache->logpath);
+	else {
+		if (fp != NULL)
+			unlink(tmppath);
+		ok = FALSE;
+	}
+	xfree(tmppath);
+	xfree(distinct);
+	xfree(types);
+	xfree(entries);
+
+	return ok;
+}
+
+/*
+ * Save the types found and free the cache. Saving is best effort,
+ * failing to save a cache is not a reason to fail a run.
+ */
+void
+typecache_close(struct typecache *cache)
+{
+	size_t logged = cache->logcount + cache->added->size;
+
+	if (logged > 0 && logged * MAX_LOG_RATIO > cache->count) {
+		if (!compact(cache))
+			append_log(cache);
+	} else if (cache->added->size > 0)
+		append_log(cache);
+
+	if (cache->map != NULL)
+		munmap(cache->map, cache->mapsize);
+
+	pthread_mutex_destroy(&cache->lock);
+	vector_free(cache->added);
+	arena_free(cache->arena);
+	xfree(cache->log);
+	xfree(cache->logpath);
+	xfree(cache->path);
+	xfree(cache);
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2024 Axel Scheepers
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TYPECACHE_H
+#define TYPECACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * A media type cache keyed on the identity and version of a file.
+ *
+ * The cache file holds a header, records sorted by (dev, ino) and a
+ * table of type strings the records point into. It is mapped into
+ * memory as is. New types are appended to a log next to it which is
+ * merged into the cache file once it grows too big.
+ */
+#define TYPECACHE_MAGIC "SHTYPES1"
+
+struct arena;
+struct vector;
+
+struct typecache_key {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t mtime;
+	uint64_t size;
+};
+
+struct typecache_header {
+	char magic[8];
+	uint64_t count;			/* number of records */
+	uint64_t strsize;		/* size of the string table */
+};
+
+/*
+ * In the cache file type is the offset of the type in the string
+ * table, in the log it is the length of the type following it.
+ */
+struct typecache_record {
+	struct typecache_key key;
+	uint32_t type;
+	uint32_t unused;
+};
+
+/* a cache entry outside of the mapped file */
+struct typecache_entry {
+	struct typecache_key key;
+	const char *type;
+	size_t seq;			/* later entries win */
+};
+
+struct typecache {
+	char *path;
+	char *logpath;
+
+	/* the mapped cache file */
+	void *map;
+	size_t mapsize;
+	const struct typecache_record *records;
+	size_t count;
+	const char *strings;
+	size_t strsize;
+
+	/* entries read from the log, sorted like the cache file */
+	struct typecache_entry *log;
+	size_t logcount;
+
+	/* types found during this run */
+	pthread_mutex_t lock;
+	struct vector *added;
+	struct arena *arena;
+};
+
+struct typecache *typecache_open(const char *);
+const char *typecache_get(const struct typecache *,
+    const struct typecache_key *);
+void typecache_put(struct typecache *, const struct typecache_key *,
+    const char *);
+void typecache_close(struct typecache *);
+
+#endif
@@ -14,12 +14,24 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE 1
+#ifdef __linux__
+#define _GNU_SOURCE 1			/* for copy_file_range */
+#endif
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#include <dirent.h>
 #include <fcntl.h>
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #include <ctype.h>
@@ -27,8 +39,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "hashset.h"
+#include "scanindex.h"
 #include "utils.h"
+#include "vector.h"
 
 void
 die(const char *fmt, ...)
@@ -60,6 +76,112 @@ xcalloc(size_t nmemb, size_t size)
 	return ptr;
 }
 
+struct arena *
+arena_new(void)
+{
+	return xcalloc(1, sizeof(struct arena));
+}
+
+#define ARENA_ALIGN sizeof(((struct arena_block *)0)->align)
+
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_block *block;
+	char *ptr;
+
+	size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+
+	if (size > arena->left) {
+		/*
+		 * Big allocations get a block of their own which is put
+		 * behind the current one so it's free space isn't lost.
+		 */
+		if (size > ARENA_BLOCK_SIZE / 4 && arena->blocks != NULL) {
+			block = xcalloc(1, sizeof(*block) + size);
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+
+			return block + 1;
+		}
+
+		block = xcalloc(1, sizeof(*block) +
+		    (size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE));
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->next = (char *)(block + 1);
+		arena->left = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+	}
+
+	ptr = arena->next;
+	arena->next += size;
+	arena->left -= size;
+
+	return ptr;
+}
+
+#undef ARENA_ALIGN
+
+char *
+arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+	char *dup;
+
+	dup = arena_alloc(arena, len + 1);
+	memcpy(dup, str, len);
+	dup[len] = '\0';
+
+	return dup;
+}
+
+char *
+arena_strdup(struct arena *arena, const char *str)
+{
+	if (str == NULL)
+		return NULL;
+
+	return arena_strndup(arena, str, strlen(str));
+}
+
+/*
+ * Move all memory of src into dst and free src.
+ */
+void
+arena_merge(struct arena *dst, struct arena *src)
+{
+	struct arena_block *last;
+
+	if (src->blocks != NULL) {
+		for (last = src->blocks; last->next != NULL; last = last->next)
+			continue;
+
+		/* keep allocating from the current block of dst */
+		if (dst->blocks != NULL) {
+			last->next = dst->blocks->next;
+			dst->blocks->next = src->blocks;
+		} else {
+			dst->blocks = src->blocks;
+			dst->next = src->next;
+			dst->left = src->left;
+		}
+	}
+
+	xfree(src);
+}
+
+void
+arena_free(struct arena *arena)
+{
+	while (arena->blocks != NULL) {
+		struct arena_block *next = arena->blocks->next;
+
+		xfree(arena->blocks);
+		arena->blocks = next;
+	}
+
+	xfree(arena);
+}
+
 void
 xlink(const char *src, const char *dst)
 {
@@ -67,6 +189,119 @@ xlink(const char *src, const char *dst)
 		die("Can't link '%s' to '%s':", src, dst);
 }
 
+/* size of the buffer used when the kernel can't copy a file itself */
+#define COPY_BUFSIZE (256 * 1024)
+
+/*
+ * Copy the data of from to to. A clone shares the blocks of the
+ * source, copy_file_range lets the kernel copy without passing the
+ * data through user space, read and write always work.
+ */
+static int
+copy_contents(int from, int to)
+{
+	char *buf;
+	ssize_t n;
+	int ok = TRUE;
+
+#ifdef FICLONE
+	if (ioctl(to, FICLONE, from) == 0)
+		return TRUE;
+#endif
+
+#ifdef __linux__
+	for (;;) {
+		n = copy_file_range(from, NULL, to, NULL, 1024 * 1024 * 1024,
+		    0);
+		if (n == 0)
+			return TRUE;
+		if (n == -1)
+			break;
+	}
+
+	/* only fall back if nothing was copied yet */
+	if (lseek(to, 0, SEEK_CUR) != 0 || (errno != EXDEV &&
+	    errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP))
+		return FALSE;
+#endif
+
+	buf = xcalloc(1, COPY_BUFSIZE);
+	while (ok && (n = read(from, buf, COPY_BUFSIZE)) != 0) {
+		ssize_t done, written;
+
+		if (n == -1) {
+			ok = errno == EINTR;
+			continue;
+		}
+
+		for (done = 0; ok && done < n; done += written) {
+			written = write(to, buf + done, n - done);
+			if (written == -1) {
+				ok = errno == EINTR;
+				written = 0;
+			}
+		}
+	}
+	xfree(buf);
+
+	return ok;
+}
+
+#undef COPY_BUFSIZE
+
+/*
+ * Copy the file src relative to the directory src_dir to a new file
+ * dst relative to dst_dir, keeping its mode and times. Returns FALSE
+ * with errno set if it could not be copied.
+ */
+int
+copy_file_at(int src_dir, const char *src, int dst_dir, const char *dst)
+{
+	struct timespec times[2];
+	struct stat st;
+	int from, to, ok, saved_errno;
+
+	from = openat(src_dir, src, O_RDONLY);
+	if (from == -1)
+		return FALSE;
+
+	if (fstat(from, &st) == -1) {
+		saved_errno = errno;
+		close(from);
+		errno = saved_errno;
+		return FALSE;
+	}
+
+	to = openat(dst_dir, dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (to == -1) {
+		saved_errno = errno;
+		close(from);
+		errno = saved_errno;
+		return FALSE;
+	}
+
+	posix_fadvise(from, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	ok = copy_contents(from, to) && fchmod(to, st.st_mode & 07777) == 0 &&
+	    futimens(to, times) == 0;
+
+	saved_errno = errno;
+	posix_fadvise(from, 0, 0, POSIX_FADV_DONTNEED);
+	close(from);
+	if (close(to) == -1 && ok) {
+		saved_errno = errno;
+		ok = FALSE;
+	}
+
+	if (!ok)
+		unlinkat(dst_dir, dst, 0);
+	errno = saved_errno;
+
+	return ok;
+}
+
 void *
 xrealloc(void *ptr, size_t size)
 {
@@ -134,19 +369,30 @@ string_to_number(const char *str)
 	return 0;
 }
 
+/* format num with a unit into buf of at least NUMBER_BUFSIZE bytes */
 char *
-number_to_string(double num)
+format_number(char *buf, double num)
 {
-	char str[BUFSIZE];
 	char units[] = { 'b', 'K', 'M', 'G', 'T' };
 	int i;
 
-	for (i = 0; num > KB && i < (int)sizeof(units); ++i)
+	for (i = 0; num > KB && i < (int)sizeof(units) - 1; ++i)
 		num /= KB;
 
-	sprintf(str, "%.*f%c", i == 0 ? 0 : 2, num, units[i]);
+	if (num >= 1e18)
+		sprintf(buf, "%.2e%c", num, units[i]);
+	else
+		sprintf(buf, "%.*f%c", i == 0 ? 0 : 2, num, units[i]);
+
+	return buf;
+}
+
+char *
+number_to_string(double num)
+{
+	char str[NUMBER_BUFSIZE];
 
-	return xstrdup(str);
+	return xstrdup(format_number(str, num));
 }
 
 #undef KB
@@ -154,6 +400,28 @@ number_to_string(double num)
 #undef GB
 #undef TB
 
+/*
+ * Compare paths like strcmp would if a slash sorted before any other
+ * character. A directory then sorts right before the paths in it, and
+ * if one path of a directory sorts before another so do the paths of
+ * everything in it.
+ */
+int
+path_cmp(const char *a, const char *b)
+{
+	for (; *a == *b && *a != '\0'; ++a, ++b)
+		;
+
+	if (*a == *b)
+		return 0;
+	if (*a == '\0' || (*a == '/' && *b != '\0'))
+		return -1;
+	if (*b == '\0' || *b == '/')
+		return 1;
+
+	return (uchar)*a - (uchar)*b;
+}
+
 char *
 clean_path(char *path)
 {
@@ -185,7 +453,11 @@ clean_path(char *path)
 	return ret;
 }
 
-static void
+/*
+ * Make a directory, one which is there already has to have the mode
+ * it would have been made with.
+ */
+void
 xmkdir(const char *path, mode_t mode)
 {
 	struct stat st;
@@ -216,11 +488,744 @@ make_directories(char *path)
 	char *slashpos = path;
 	mode_t mode = 0700;
 
+	/* directories leading up to path only need to be directories */
 	while ((slashpos = strchr(++slashpos, '/')) != NULL) {
+		struct stat st;
+
 		*slashpos = '\0';
-		xmkdir(path, mode);
+		if (mkdir(path, mode) == -1 && errno != EEXIST)
+			die("Can't make directory '%s':", path);
+		if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+			die("'%s' is not a directory.", path);
 		*slashpos = '/';
 	}
 
 	xmkdir(path, mode);
 }
+
+int
+cpu_count(void)
+{
+	long n = -1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	return n < 1 ? 1 : (int)n;
+}
+
+int stats_enabled;
+ulong stats_counts[STATS_NCOUNTERS];
+
+static const char *const stats_names[STATS_NCOUNTERS] = {
+	"files visited", "stats issued", "magic calls", "comparisons",
+	"disks probed", "children spawned"
+};
+
+static struct {
+	struct {
+		const char *name;
+		double seconds;
+	} phases[STATS_MAXPHASES];
+	size_t nphases;
+	size_t current;			/* STATS_MAXPHASES if none */
+	double started;
+	double mark;
+	pthread_mutex_t lock;
+} stats;
+
+static double
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Print the time spent in every phase, in the order they were first
+ * entered, and the counters which were used to stderr.
+ */
+static void
+stats_print(void)
+{
+	size_t i;
+
+	stats_phase(NULL);
+	fflush(stdout);
+
+	fprintf(stderr, "%-20s %12s\n", "phase", "seconds");
+	for (i = 0; i < stats.nphases; ++i)
+		fprintf(stderr, "%-20s %12.3f\n", stats.phases[i].name,
+		    stats.phases[i].seconds);
+	fprintf(stderr, "%-20s %12.3f\n", "total",
+	    stats_now() - stats.started);
+
+	for (i = 0; i < STATS_NCOUNTERS; ++i)
+		if (stats_counts[i] > 0)
+			fprintf(stderr, "%-20s %12lu\n", stats_names[i],
+			    stats_counts[i]);
+}
+
+/* start collecting stats, they are printed when the program exits */
+void
+stats_start(void)
+{
+	if (stats_enabled)
+		return;
+
+	stats_enabled = TRUE;
+	stats.current = STATS_MAXPHASES;
+	stats.started = stats.mark = stats_now();
+	pthread_mutex_init(&stats.lock, NULL);
+	atexit(stats_print);
+}
+
+/*
+ * End the current phase and start the one called name, time spent in
+ * a phase entered before is added to it. NULL only ends the current
+ * phase. Only the main thread switches phases.
+ */
+void
+stats_phase(const char *name)
+{
+	double now;
+	size_t i;
+
+	if (!stats_enabled)
+		return;
+
+	now = stats_now();
+	if (stats.current < STATS_MAXPHASES)
+		stats.phases[stats.current].seconds += now - stats.mark;
+	stats.mark = now;
+	stats.current = STATS_MAXPHASES;
+
+	if (name == NULL)
+		return;
+
+	for (i = 0; i < stats.nphases; ++i)
+		if (strcmp(stats.phases[i].name, name) == 0)
+			break;
+
+	if (i == stats.nphases) {
+		if (i == STATS_MAXPHASES)
+			die("stats_phase: too many phases.");
+
+		stats.phases[i].name = name;
+		stats.phases[i].seconds = 0;
+		++stats.nphases;
+	}
+	stats.current = i;
+}
+
+/* add to a counter from any thread */
+void
+stats_add(int counter, ulong n)
+{
+	if (!stats_enabled || n == 0)
+		return;
+
+	pthread_mutex_lock(&stats.lock);
+	stats_counts[counter] += n;
+	pthread_mutex_unlock(&stats.lock);
+}
+
+/*
+ * The walker keeps a queue of directories per thread. A thread takes
+ * the most recently found directory from its own queue and when that
+ * is empty steals the oldest directory from another thread's queue.
+ * Entries are stat'ed relative to the directory descriptor and, unless
+ * WALK_STAT is given, d_type is used to avoid the stat altogether.
+ * When symbolic links are followed a directory can be reached by more
+ * than one path, see walk_enter.
+ */
+struct walk_dir {
+	char *path;
+	size_t len;
+	size_t index;
+	int level;
+};
+
+struct walk_queue {
+	pthread_mutex_t lock;
+	struct walk_dir *dirs;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+};
+
+struct walk_state {
+	const struct walk *walk;
+	struct walk_queue *queues;
+	int nthreads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t queued;			/* directories waiting in a queue */
+	size_t pending;			/* directories queued or being read */
+
+	pthread_mutex_t seen_lock;
+	struct hashset *seen;		/* directories entered, without WALK_PHYS */
+	struct vector *entered;		/* the path each of those was entered by */
+};
+
+struct walk_worker {
+	struct walk_state *state;
+	struct walk_out out;
+	struct vector *records;
+	pthread_t thread;
+	int id;
+
+	char *buf;
+	size_t bufsize;
+
+	/* added to the stats once the walk is done */
+	ulong visited;
+	ulong stats;
+};
+
+static void
+walk_push(struct walk_worker *worker, char *path, size_t len, int level)
+{
+	struct walk_state *state = worker->state;
+	struct walk_queue *queue = &state->queues[worker->id];
+	struct walk_dir *dir;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head == queue->tail)
+		queue->head = queue->tail = 0;
+
+	if (queue->tail == queue->capacity) {
+		size_t new_capacity = queue->capacity + (queue->capacity >> 1);
+
+		if (new_capacity < 16)
+			new_capacity = 16;
+
+		queue->dirs = xrealloc(queue->dirs,
+		    new_capacity * sizeof(queue->dirs[0]));
+		queue->capacity = new_capacity;
+	}
+
+	dir = &queue->dirs[queue->tail++];
+	dir->path = path;
+	dir->len = len;
+	dir->index = WALK_NODIR;
+	dir->level = level;
+
+	/* number the directory before another thread can steal it */
+	pthread_mutex_lock(&state->lock);
+	if (state->walk->dirs != NULL) {
+		dir->index = state->walk->dirs->size;
+		vector_add(state->walk->dirs, path);
+	}
+
+	++state->queued;
+	++state->pending;
+	pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->lock);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static int
+walk_pop(struct walk_worker *worker, struct walk_dir *dir)
+{
+	struct walk_state *state = worker->state;
+	int found = FALSE;
+	int i;
+
+	for (i = 0; i < state->nthreads && !found; ++i) {
+		struct walk_queue *queue;
+
+		queue = &state->queues[(worker->id + i) % state->nthreads];
+		pthread_mutex_lock(&queue->lock);
+		if (queue->head < queue->tail) {
+			/* depth first from our own queue, steal breadth first */
+			if (i == 0)
+				*dir = queue->dirs[--queue->tail];
+			else
+				*dir = queue->dirs[queue->head++];
+			found = TRUE;
+		}
+		pthread_mutex_unlock(&queue->lock);
+	}
+
+	if (found) {
+		pthread_mutex_lock(&state->lock);
+		--state->queued;
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	return found;
+}
+
+static int
+walk_type(mode_t mode)
+{
+	if (S_ISREG(mode))
+		return WALK_F;
+	if (S_ISDIR(mode))
+		return WALK_D;
+	if (S_ISLNK(mode))
+		return WALK_SL;
+
+	return WALK_OTHER;
+}
+
+static int
+walk_descend(const struct walk *walk, int level)
+{
+	return walk->maxlevel < 0 || level < walk->maxlevel;
+}
+
+/*
+ * Report an entry of dir of which the type and stat are already set
+ * and queue it if it is a directory to descend into.
+ */
+static void
+walk_report(struct walk_worker *worker, struct walk_dir *dir,
+    struct walk_entry *ent, struct scanindex_record *record)
+{
+	const struct walk *walk = worker->state->walk;
+	size_t len, namelen;
+
+	namelen = ent->namelen;
+	len = dir->len + namelen + 2;
+	if (len > worker->bufsize) {
+		worker->bufsize = len * 2;
+		worker->buf = xrealloc(worker->buf, worker->bufsize);
+	}
+
+	memcpy(worker->buf, dir->path, dir->len);
+	len = dir->len;
+	if (len == 0 || worker->buf[len - 1] != '/')
+		worker->buf[len++] = '/';
+	memcpy(worker->buf + len, ent->name, namelen);
+	worker->buf[len + namelen] = '\0';
+
+	ent->path = worker->buf;
+	ent->name = worker->buf + len;
+
+	++worker->visited;
+	walk->fn(&worker->out, ent);
+
+	if (record != NULL) {
+		struct scanindex_entry *entry;
+
+		entry = arena_alloc(worker->out.arena, sizeof(*entry));
+		memset(entry, 0, sizeof(*entry));
+		entry->name = arena_strndup(worker->out.arena, ent->name,
+		    namelen);
+		entry->type = ent->type;
+		if (ent->st != NULL) {
+			entry->size = ent->st->st_size;
+			entry->blocks = ent->st->st_blocks;
+			entry->mtime = ent->st->st_mtime;
+			entry->dev = ent->st->st_dev;
+			entry->ino = ent->st->st_ino;
+		}
+		vector_add(record->entries, entry);
+	}
+
+	if (ent->type == WALK_D && walk_descend(walk, ent->level))
+		walk_push(worker, arena_strndup(worker->out.arena,
+		    ent->path, len + namelen), len + namelen, ent->level);
+}
+
+/*
+ * Report the entries of a directory from the index instead of reading
+ * the directory itself.
+ */
+static void
+walk_replay(struct walk_worker *worker, struct walk_dir *dir,
+    const struct scanindex_dir *idir, struct scanindex_record *record)
+{
+	const struct scanindex *index = worker->state->walk->index;
+	struct walk_entry ent;
+	struct stat st;
+	size_t i;
+
+	memset(&ent, 0, sizeof(ent));
+	ent.dir = dir->index;
+	ent.level = dir->level + 1;
+
+	for (i = 0; i < idir->count; ++i) {
+		const struct scanindex_file *file;
+
+		file = &index->entries[idir->first + i];
+		if (file->name >= index->header->strsize)
+			die("Damaged index entry in '%s'.", dir->path);
+
+		memset(&st, 0, sizeof(st));
+		st.st_size = file->size;
+		st.st_blocks = file->blocks;
+		st.st_mtime = file->mtime;
+		st.st_dev = file->dev;
+		st.st_ino = file->ino;
+		switch (file->type) {
+		case WALK_F:
+			st.st_mode = S_IFREG;
+			break;
+		case WALK_D:
+			st.st_mode = S_IFDIR;
+			break;
+		case WALK_SL:
+			st.st_mode = S_IFLNK;
+			break;
+		}
+
+		ent.name = index->strings + file->name;
+		ent.namelen = strlen(ent.name);
+		ent.type = file->type;
+		ent.st = file->type == WALK_NS ? NULL : &st;
+		walk_report(worker, dir, &ent, record);
+	}
+}
+
+/*
+ * Returns FALSE if the directory of st shouldn't be read by path. Of
+ * the paths a directory is reached by the smallest in path_cmp order
+ * wins, no matter which thread gets there first. A path is skipped if
+ * the directory was entered by a smaller one, which also skips links
+ * looping back, and read if it is smaller than the path it was entered
+ * by so far. The files found by the larger path then have to be dropped
+ * by the callback, like other files found more than once.
+ */
+static int
+walk_enter(struct walk_worker *worker, const struct stat *st,
+    const char *path)
+{
+	struct walk_state *state = worker->state;
+	size_t *entered;
+	int enter = TRUE;
+
+	if (state->seen == NULL)
+		return TRUE;
+
+	pthread_mutex_lock(&state->seen_lock);
+	entered = hashset_value(state->seen, st->st_dev, st->st_ino);
+	if (*entered == HASHSET_NONE) {
+		*entered = state->entered->size;
+		vector_add(state->entered, (char *)path);
+	} else if (path_cmp(path, state->entered->items[*entered]) < 0)
+		state->entered->items[*entered] = (char *)path;
+	else
+		enter = FALSE;
+	pthread_mutex_unlock(&state->seen_lock);
+
+	return enter;
+}
+
+static void
+walk_read(struct walk_worker *worker, struct walk_dir *dir)
+{
+	const struct walk *walk = worker->state->walk;
+	struct scanindex_record *record = NULL;
+	struct walk_entry ent;
+	struct dirent *de;
+	struct stat st;
+	DIR *dp;
+	int fd, flags, statflags, entered = FALSE;
+
+	/* an index needs to know everything about every entry */
+	flags = walk->flags;
+	if (walk->records != NULL)
+		flags |= WALK_STAT;
+
+	statflags = (flags & WALK_PHYS) ? AT_SYMLINK_NOFOLLOW : 0;
+
+	memset(&ent, 0, sizeof(ent));
+	ent.dir = dir->index;
+	ent.level = dir->level + 1;
+
+	if (walk->index != NULL || walk->records != NULL) {
+		const struct scanindex_dir *idir = NULL;
+
+		++worker->stats;
+		if (stat(dir->path, &st) == 0) {
+			if (!walk_enter(worker, &st, dir->path))
+				return;
+			entered = TRUE;
+
+			if (walk->index != NULL)
+				idir = scanindex_find(walk->index, dir->path,
+				    st.st_mtime);
+
+			if (walk->records != NULL) {
+				record = arena_alloc(worker->out.arena,
+				    sizeof(*record));
+				record->path = dir->path;
+				record->mtime = st.st_mtime;
+				record->entries = vector_new();
+				vector_add(worker->records, record);
+			}
+		}
+
+		if (idir != NULL) {
+			walk_replay(worker, dir, idir, record);
+			return;
+		}
+	}
+
+	fd = open(dir->path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1 || (dp = fdopendir(fd)) == NULL) {
+		if (fd != -1)
+			close(fd);
+
+		/* don't index what we can't read */
+		if (record != NULL)
+			record->mtime = 0;
+
+		ent.path = dir->path;
+		ent.name = strrchr(dir->path, '/');
+		ent.name = ent.name == NULL ? dir->path : ent.name + 1;
+		ent.namelen = strlen(ent.name);
+		ent.dir = WALK_NODIR;
+		ent.type = WALK_DNR;
+		ent.level = dir->level;
+		walk->fn(&worker->out, &ent);
+
+		return;
+	}
+
+	if (!entered) {
+		++worker->stats;
+		if (fstat(fd, &st) == 0 &&
+		    !walk_enter(worker, &st, dir->path)) {
+			closedir(dp);
+			return;
+		}
+	}
+
+	while ((de = readdir(dp)) != NULL) {
+		const char *name = de->d_name;
+
+		if (name[0] == '.' && (name[1] == '\0' ||
+		    (name[1] == '.' && name[2] == '\0')))
+			continue;
+
+		ent.name = name;
+		ent.namelen = strlen(name);
+		ent.st = NULL;
+		ent.type = -1;
+
+#ifdef DT_UNKNOWN
+		if (!(flags & WALK_STAT)) {
+			switch (de->d_type) {
+			case DT_REG:
+				ent.type = WALK_F;
+				break;
+			case DT_DIR:
+				ent.type = WALK_D;
+				break;
+			case DT_LNK:
+				if (flags & WALK_PHYS)
+					ent.type = WALK_SL;
+				break;
+			case DT_UNKNOWN:
+				break;
+			default:
+				ent.type = WALK_OTHER;
+				break;
+			}
+		}
+#endif
+
+		if (ent.type == -1) {
+			++worker->stats;
+			if (fstatat(fd, name, &st, statflags) == -1)
+				ent.type = WALK_NS;
+			else {
+				ent.st = &st;
+				ent.type = walk_type(st.st_mode);
+			}
+		}
+
+		walk_report(worker, dir, &ent, record);
+	}
+
+	closedir(dp);
+}
+
+static void *
+walk_worker(void *worker_ptr)
+{
+	struct walk_worker *worker = worker_ptr;
+	struct walk_state *state = worker->state;
+	struct walk_dir dir;
+
+	memset(&dir, 0, sizeof(dir));
+	for (;;) {
+		if (walk_pop(worker, &dir)) {
+			walk_read(worker, &dir);
+
+			pthread_mutex_lock(&state->lock);
+			if (--state->pending == 0)
+				pthread_cond_broadcast(&state->cond);
+			pthread_mutex_unlock(&state->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&state->lock);
+		while (state->queued == 0 && state->pending > 0)
+			pthread_cond_wait(&state->cond, &state->lock);
+
+		if (state->pending == 0) {
+			pthread_mutex_unlock(&state->lock);
+			break;
+		}
+		pthread_mutex_unlock(&state->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Walk the given paths with several threads calling walk->fn for every
+ * entry found, including the paths themselves. The callback adds its
+ * results to the walk_out of the calling thread which are merged into
+ * out when the walk is done. Callbacks run concurrently so they should
+ * only touch their walk_out or take care of their own locking.
+ *
+ * Memory for results should come from the walk_out arena, these are
+ * merged into arena afterwards. If walk->dirs is set every directory
+ * path is added to it and entries refer to their directory by index,
+ * so a record can be kept as just the index and the entry name.
+ *
+ * If walk->index is set directories which didn't change since they
+ * were indexed are not read but replayed from the index. If
+ * walk->records is set it gets a scanindex_record for every directory
+ * to build a new index from.
+ */
+void
+walk(const struct walk *walk, char *const *paths, size_t npaths,
+    struct vector *out, struct arena *arena)
+{
+	struct walk_worker *workers;
+	struct walk_state state;
+	int statflags;
+	size_t i;
+	int n;
+
+	statflags = (walk->flags & WALK_PHYS) ? AT_SYMLINK_NOFOLLOW : 0;
+
+	memset(&state, 0, sizeof(state));
+	state.walk = walk;
+	state.nthreads = walk->nthreads > 0 ? walk->nthreads : cpu_count();
+	state.queues = xcalloc(state.nthreads, sizeof(state.queues[0]));
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.cond, NULL);
+	pthread_mutex_init(&state.seen_lock, NULL);
+	if (!(walk->flags & WALK_PHYS)) {
+		state.seen = hashset_new();
+		state.entered = vector_new();
+	}
+
+	workers = xcalloc(state.nthreads, sizeof(workers[0]));
+	for (n = 0; n < state.nthreads; ++n) {
+		pthread_mutex_init(&state.queues[n].lock, NULL);
+		workers[n].state = &state;
+		workers[n].out.items = vector_new();
+		workers[n].out.arena = arena_new();
+		workers[n].records = vector_new();
+		workers[n].id = n;
+	}
+
+	/* report the starting points and spread them over the threads */
+	for (i = 0; i < npaths; ++i) {
+		struct walk_worker *worker = &workers[i % state.nthreads];
+		struct walk_entry ent;
+		struct stat st;
+
+		if (fstatat(AT_FDCWD, paths[i], &st, statflags) == -1)
+			die("Can't access '%s':", paths[i]);
+
+		memset(&ent, 0, sizeof(ent));
+		ent.path = paths[i];
+		ent.name = strrchr(paths[i], '/');
+		ent.name = ent.name == NULL ? paths[i] : ent.name + 1;
+		ent.namelen = strlen(ent.name);
+		ent.dir = WALK_NODIR;
+		ent.st = &st;
+		ent.type = walk_type(st.st_mode);
+		ent.level = 0;
+		walk->fn(&worker->out, &ent);
+
+		if (ent.type == WALK_D && walk_descend(walk, 0))
+			walk_push(worker, arena_strdup(worker->out.arena,
+			    paths[i]), strlen(paths[i]), 0);
+	}
+
+	stats_add(STATS_FILES, npaths);
+	stats_add(STATS_STATS, npaths);
+
+	for (n = 0; n < state.nthreads; ++n)
+		if (pthread_create(&workers[n].thread, NULL, walk_worker,
+		    &workers[n]) != 0)
+			die("Can't create walker thread.");
+
+	for (n = 0; n < state.nthreads; ++n)
+		pthread_join(workers[n].thread, NULL);
+
+	for (n = 0; n < state.nthreads; ++n) {
+		/* a walk can run next to the main thread */
+		stats_add(STATS_FILES, workers[n].visited);
+		stats_add(STATS_STATS, workers[n].stats);
+		vector_append(out, workers[n].out.items);
+		vector_free(workers[n].out.items);
+		if (walk->records != NULL)
+			vector_append(walk->records, workers[n].records);
+		vector_free(workers[n].records);
+		if (arena != NULL)
+			arena_merge(arena, workers[n].out.arena);
+		else
+			arena_free(workers[n].out.arena);
+		xfree(workers[n].buf);
+		xfree(state.queues[n].dirs);
+		pthread_mutex_destroy(&state.queues[n].lock);
+	}
+
+	if (state.seen != NULL) {
+		hashset_free(state.seen);
+		vector_free(state.entered);
+	}
+	pthread_mutex_destroy(&state.seen_lock);
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.lock);
+	xfree(state.queues);
+	xfree(workers);
+}
+
+/*
+ * Walk using the index at indexpath and replace it with an up to date
+ * one afterwards. Without an indexpath this is just a walk.
+ */
+void
+walk_indexed(struct walk *walker, char *const *paths, size_t npaths,
+    struct vector *out, struct arena *arena, const char *indexpath)
+{
+	time_t created;
+
+	if (indexpath == NULL) {
+		walk(walker, paths, npaths, out, arena);
+		return;
+	}
+
+	created = time(NULL);
+	walker->index = scanindex_open(indexpath, walker->flags & WALK_PHYS);
+	walker->records = vector_new();
+
+	walk(walker, paths, npaths, out, arena);
+
+	if (!scanindex_write(indexpath, walker->records, created,
+	    walker->flags & WALK_PHYS))
+		fprintf(stderr, "Can't write index '%s'.\n", indexpath);
+
+	scanindex_records_free(walker->records);
+	scanindex_close(walker->index);
+	walker->records = NULL;
+	walker->index = NULL;
+}
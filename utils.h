@@ -23,8 +23,42 @@
 /* buffer big enough for storing the header string */
 #define BUFSIZE 1024
 
-/* maximum number of file descriptors ftw will use */
-#define MAXFD 32
+/* buffer big enough for a number formatted with a unit */
+#define NUMBER_BUFSIZE 32
+
+/* entry types passed to a walk callback */
+enum { WALK_F, WALK_D, WALK_SL, WALK_OTHER, WALK_NS, WALK_DNR };
+
+/* walk flags */
+#define WALK_PHYS 0x01		/* don't follow symbolic links */
+#define WALK_STAT 0x02		/* always stat, don't trust d_type */
+
+/* directory index of the starting points */
+#define WALK_NODIR ((size_t)-1)
+
+/* counters kept while stats are enabled */
+enum {
+	STATS_FILES,			/* entries reported by a walk */
+	STATS_STATS,			/* stat calls */
+	STATS_MAGIC,			/* libmagic lookups */
+	STATS_COMPARES,			/* comparisons of sorts on the main thread */
+	STATS_PROBES,			/* free space index nodes looked at */
+	STATS_CHILDREN,			/* commands started */
+	STATS_NCOUNTERS
+};
+
+/* phases timed while stats are enabled */
+#define STATS_MAXPHASES 16
+
+/*
+ * Count on the main thread, other threads keep their own counts and
+ * hand them to stats_add once. This is all it costs with stats off.
+ */
+#define STATS_COUNT(counter, n) \
+	do { if (stats_enabled) stats_counts[counter] += (n); } while (0)
+
+/* size of the blocks an arena carves its allocations from */
+#define ARENA_BLOCK_SIZE (64 * 1024)
 
 #define xfree(p) do { free(p); (p) = NULL; } while (0)
 
@@ -35,14 +69,87 @@ typedef unsigned short ushort;
 typedef unsigned int uint;
 typedef unsigned long ulong;
 
+struct scanindex;
+struct stat;
+struct vector;
+
+/*
+ * An arena hands out memory from large blocks which are only freed
+ * all at once with arena_free.
+ */
+struct arena_block {
+	struct arena_block *next;
+	union {
+		long l;
+		double d;
+		void *p;
+	} align;
+};
+
+struct arena {
+	struct arena_block *blocks;
+	char *next;
+	size_t left;
+};
+
+struct walk_entry {
+	const char *path;		/* path including the starting point */
+	const char *name;		/* last component of path */
+	size_t namelen;
+	size_t dir;			/* index in walk->dirs or WALK_NODIR */
+	const struct stat *st;		/* NULL if the type came from d_type */
+	int type;
+	int level;			/* the starting point is level 0 */
+};
+
+/* results collected by one walker thread */
+struct walk_out {
+	struct vector *items;
+	struct arena *arena;
+	void *data;			/* for the callback, NULL at first */
+};
+
+typedef void (*walk_fn)(struct walk_out *, const struct walk_entry *);
+
+struct walk {
+	walk_fn fn;
+	int flags;
+	int maxlevel;			/* don't read directories at this level */
+	int nthreads;			/* 0 uses one thread per cpu */
+	struct vector *dirs;		/* if set, gets every directory read */
+	struct scanindex *index;	/* if set, replay unchanged directories */
+	struct vector *records;		/* if set, gets scanindex records */
+};
+
+extern int stats_enabled;
+extern ulong stats_counts[STATS_NCOUNTERS];
+
 void die(const char *, ...);
 void *xcalloc(size_t, size_t);
+struct arena *arena_new(void);
+void *arena_alloc(struct arena *, size_t);
+char *arena_strdup(struct arena *, const char *);
+char *arena_strndup(struct arena *, const char *, size_t);
+void arena_merge(struct arena *, struct arena *);
+void arena_free(struct arena *);
 void xlink(const char *, const char *);
+int copy_file_at(int, const char *, int, const char *);
 void *xrealloc(void *, size_t);
 char *xstrdup(const char *);
 off_t string_to_number(const char *);
+char *format_number(char *, double);
 char *number_to_string(double);
+int path_cmp(const char *, const char *);
 char *clean_path(char *);
+void xmkdir(const char *, mode_t);
 void make_directories(char *);
+int cpu_count(void);
+void stats_start(void);
+void stats_phase(const char *);
+void stats_add(int, ulong);
+void walk(const struct walk *, char *const *, size_t, struct vector *,
+    struct arena *);
+void walk_indexed(struct walk *, char *const *, size_t, struct vector *,
+    struct arena *, const char *);
 
 #endif
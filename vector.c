@@ -16,14 +16,20 @@
 
 #define _XOPEN_SOURCE 600
 #include <sys/types.h>
+#include <pthread.h>
 #include <unistd.h>
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#include "rng.h"
 #include "vector.h"
 #include "utils.h"
 
+DEFINE_VECTOR(index_vector, size_t);
+
 struct vector *
 vector_new(void)
 {
@@ -60,6 +66,29 @@ vector_add(struct vector *v, void *data)
 	v->items[v->size++] = data;
 }
 
+/*
+ * Add all items of src to the end of dst.
+ */
+void
+vector_append(struct vector *dst, const struct vector *src)
+{
+	if (dst->size + src->size > dst->capacity) {
+		size_t new_capacity = dst->capacity + (dst->capacity >> 1);
+		size_t new_size;
+
+		if (new_capacity < dst->size + src->size)
+			new_capacity = dst->size + src->size;
+
+		new_size = new_capacity * sizeof(dst->items[0]);
+		dst->items = xrealloc(dst->items, new_size);
+		dst->capacity = new_capacity;
+	}
+
+	memcpy(dst->items + dst->size, src->items,
+	    src->size * sizeof(src->items[0]));
+	dst->size += src->size;
+}
+
 void
 vector_foreach(const struct vector *v, void (*fn)(void *))
 {
@@ -69,25 +98,222 @@ vector_foreach(const struct vector *v, void (*fn)(void *))
 		fn(v->items[i]);
 }
 
+static struct rng vector_rng;
+static int vector_seeded;
+
+/*
+ * Seed the generator of vector_shuffle and vector_take_random, the
+ * same seed and items give the same order. Without a seed it is
+ * seeded from the time and process id.
+ */
 void
-vector_shuffle(struct vector *v)
+vector_seed(uint64_t seed)
 {
-	static unsigned int seed;
-	size_t i;
+	rng_seed(&vector_rng, seed);
+	vector_seeded = TRUE;
+}
 
-	if (seed == 0) {
-		seed = time(NULL) ^ getpid();
-		srandom(seed);
-	}
+static struct rng *
+vector_random(void)
+{
+	if (!vector_seeded)
+		vector_seed((uint64_t)time(NULL) ^ getpid());
+
+	return &vector_rng;
+}
 
-	for (i = v->size - 1; i > 0; --i) {
+static void
+fisher_yates(void **items, size_t size, struct rng *rng)
+{
+	size_t i;
+
+	for (i = size; i > 1; --i) {
 		size_t j;
 		void *tmp;
 
-		j = random() % (i + 1);
+		j = rng_below(rng, i);
 
-		tmp = v->items[i];
-		v->items[i] = v->items[j];
-		v->items[j] = tmp;
+		tmp = items[i - 1];
+		items[i - 1] = items[j];
+		items[j] = tmp;
 	}
 }
+
+/*
+ * Vectors this big are shuffled in blocks which fit in the cache, with
+ * a thread per cpu. Every block gets its own generator so the result
+ * doesn't depend on the number of threads.
+ */
+#define SHUFFLE_BLOCK (64 * 1024)
+#define SHUFFLE_BLOCKED_MIN (16 * SHUFFLE_BLOCK)
+
+enum { SHUFFLE_COUNT, SHUFFLE_SCATTER, SHUFFLE_BUCKETS };
+
+struct shuffle {
+	pthread_mutex_t lock;
+	size_t next;
+	int phase;
+
+	void **items;
+	void **out;
+	size_t size;
+	size_t nblocks;
+
+	/* per block and bucket a count, turned into an offset in out */
+	size_t *counts;
+	size_t *starts;
+	uint64_t seeds[2];
+};
+
+static void
+shuffle_block(struct shuffle *shuffle, size_t block)
+{
+	size_t *counts = shuffle->counts + block * shuffle->nblocks;
+	size_t i, end;
+	struct rng rng;
+
+	if (shuffle->phase == SHUFFLE_BUCKETS) {
+		i = shuffle->starts[block];
+		end = shuffle->starts[block + 1];
+		rng_seed(&rng, shuffle->seeds[1] + block);
+		fisher_yates(shuffle->out + i, end - i, &rng);
+		return;
+	}
+
+	/* both passes draw the same buckets for the items of a block */
+	i = block * SHUFFLE_BLOCK;
+	end = i + SHUFFLE_BLOCK < shuffle->size ? i + SHUFFLE_BLOCK :
+	    shuffle->size;
+	rng_seed(&rng, shuffle->seeds[0] + block);
+	for (; i < end; ++i) {
+		size_t bucket = rng_below(&rng, shuffle->nblocks);
+
+		if (shuffle->phase == SHUFFLE_COUNT)
+			++counts[bucket];
+		else
+			shuffle->out[counts[bucket]++] = shuffle->items[i];
+	}
+}
+
+static void *
+shuffle_worker(void *shuffle_ptr)
+{
+	struct shuffle *shuffle = shuffle_ptr;
+
+	for (;;) {
+		size_t block;
+
+		pthread_mutex_lock(&shuffle->lock);
+		block = shuffle->next++;
+		pthread_mutex_unlock(&shuffle->lock);
+
+		if (block >= shuffle->nblocks)
+			break;
+
+		shuffle_block(shuffle, block);
+	}
+
+	return NULL;
+}
+
+static void
+shuffle_phase(struct shuffle *shuffle, int phase)
+{
+	pthread_t *threads;
+	int n, nthreads;
+
+	shuffle->phase = phase;
+	shuffle->next = 0;
+
+	nthreads = cpu_count();
+	if ((size_t)nthreads > shuffle->nblocks)
+		nthreads = shuffle->nblocks;
+
+	threads = xcalloc(nthreads, sizeof(threads[0]));
+	for (n = 0; n < nthreads; ++n)
+		if (pthread_create(&threads[n], NULL, shuffle_worker,
+		    shuffle) != 0)
+			die("Can't create shuffle thread.");
+
+	for (n = 0; n < nthreads; ++n)
+		pthread_join(threads[n], NULL);
+
+	xfree(threads);
+}
+
+/*
+ * Every item is sent to a random bucket and every bucket is shuffled
+ * on its own, which gives each order the same chance like a plain
+ * Fisher-Yates pass but with far fewer cache misses.
+ */
+static void
+shuffle_blocked(struct vector *v, struct rng *rng)
+{
+	struct shuffle shuffle;
+	size_t block, bucket, offset;
+
+	pthread_mutex_init(&shuffle.lock, NULL);
+	shuffle.items = v->items;
+	shuffle.out = xcalloc(v->capacity, sizeof(v->items[0]));
+	shuffle.size = v->size;
+	shuffle.nblocks = (v->size + SHUFFLE_BLOCK - 1) / SHUFFLE_BLOCK;
+	shuffle.counts = xcalloc(shuffle.nblocks * shuffle.nblocks,
+	    sizeof(shuffle.counts[0]));
+	shuffle.starts = xcalloc(shuffle.nblocks + 1,
+	    sizeof(shuffle.starts[0]));
+	shuffle.seeds[0] = rng_next(rng);
+	shuffle.seeds[1] = rng_next(rng);
+
+	shuffle_phase(&shuffle, SHUFFLE_COUNT);
+
+	/* buckets follow each other, within one the blocks do */
+	offset = 0;
+	for (bucket = 0; bucket < shuffle.nblocks; ++bucket) {
+		shuffle.starts[bucket] = offset;
+		for (block = 0; block < shuffle.nblocks; ++block) {
+			size_t *count;
+
+			count = &shuffle.counts[block * shuffle.nblocks +
+			    bucket];
+			offset += *count;
+			*count = offset - *count;
+		}
+	}
+	shuffle.starts[shuffle.nblocks] = offset;
+
+	shuffle_phase(&shuffle, SHUFFLE_SCATTER);
+	shuffle_phase(&shuffle, SHUFFLE_BUCKETS);
+
+	xfree(v->items);
+	v->items = shuffle.out;
+
+	pthread_mutex_destroy(&shuffle.lock);
+	xfree(shuffle.counts);
+	xfree(shuffle.starts);
+}
+
+void
+vector_shuffle(struct vector *v)
+{
+	if (v->size >= SHUFFLE_BLOCKED_MIN)
+		shuffle_blocked(v, vector_random());
+	else
+		fisher_yates(v->items, v->size, vector_random());
+}
+
+/*
+ * Remove a random item from a non empty vector, the last item takes
+ * its place.
+ */
+void *
+vector_take_random(struct vector *v)
+{
+	size_t i;
+	void *item;
+
+	i = rng_below(vector_random(), v->size);
+	item = v->items[i];
+	v->items[i] = v->items[--v->size];
+
+	return item;
+}
@@ -17,6 +17,8 @@
 #ifndef VECTOR_H
 #define VECTOR_H
 
+#include <stdint.h>
+
 struct vector {
     void **items;
     size_t size;
@@ -25,10 +27,100 @@ struct vector {
 
 #define INITIAL_VECTOR_CAPACITY 128
 
+/*
+ * Vectors holding values of type T instead of pointers, so hot data
+ * can be kept in one contiguous array. DECLARE_VECTOR goes where the
+ * type is needed and DEFINE_VECTOR in a single source file.
+ *
+ * push returns a slot for a new item which is valid until the vector
+ * grows again, reserve makes room for at least n items in total.
+ */
+#define DECLARE_VECTOR(name, T)						\
+struct name {								\
+	T *items;							\
+	size_t size;							\
+	size_t capacity;						\
+};									\
+struct name *name##_new(void);						\
+void name##_free(struct name *);					\
+void name##_reserve(struct name *, size_t);				\
+void name##_shrink_to_fit(struct name *);				\
+T *name##_push(struct name *);						\
+void name##_append(struct name *, const T *, size_t)
+
+/* ends in a declaration so it can be followed by a ; */
+#define DEFINE_VECTOR(name, T)						\
+struct name *								\
+name##_new(void)							\
+{									\
+	struct name *v;							\
+									\
+	v = xcalloc(1, sizeof(*v));					\
+	v->items = xcalloc(INITIAL_VECTOR_CAPACITY, sizeof(T));		\
+	v->capacity = INITIAL_VECTOR_CAPACITY;				\
+									\
+	return v;							\
+}									\
+									\
+void									\
+name##_free(struct name *v)						\
+{									\
+	xfree(v->items);						\
+	xfree(v);							\
+}									\
+									\
+void									\
+name##_reserve(struct name *v, size_t n)				\
+{									\
+	if (n <= v->capacity)						\
+		return;							\
+									\
+	v->items = xrealloc(v->items, n * sizeof(T));			\
+	v->capacity = n;						\
+}									\
+									\
+void									\
+name##_shrink_to_fit(struct name *v)					\
+{									\
+	size_t n = v->size > 0 ? v->size : 1;				\
+									\
+	v->items = xrealloc(v->items, n * sizeof(T));			\
+	v->capacity = n;						\
+}									\
+									\
+T *									\
+name##_push(struct name *v)						\
+{									\
+	if (v->size == v->capacity)					\
+		name##_reserve(v, v->capacity + (v->capacity >> 1));	\
+									\
+	return &v->items[v->size++];					\
+}									\
+									\
+void									\
+name##_append(struct name *v, const T *items, size_t n)			\
+{									\
+	if (v->size + n > v->capacity) {				\
+		size_t capacity = v->capacity + (v->capacity >> 1);	\
+									\
+		name##_reserve(v, capacity < v->size + n ?		\
+		    v->size + n : capacity);				\
+	}								\
+									\
+	memcpy(v->items + v->size, items, n * sizeof(T));		\
+	v->size += n;							\
+}									\
+struct name
+
+DECLARE_VECTOR(index_vector, size_t);
+
 struct vector *vector_new(void);
 void vector_free(struct vector *);
 void vector_add(struct vector *, void *);
+void vector_append(struct vector *, const struct vector *);
 void vector_foreach(const struct vector *, void (*)(void *));
+void vector_seed(uint64_t);
 void vector_shuffle(struct vector *);
+void *vector_take_random(struct vector *);
 
 #endif